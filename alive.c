@@ -0,0 +1,196 @@
+#include <string.h>
+#include <time.h>
+#include "alive.h"
+#include "tlv.h"
+#include "conf.h"
+#include "egress.h"
+#include "compress.h"
+#include "timer.h"
+#include "logging.h"
+
+extern struct conf_tunnel *tunnel;
+
+#define DB(fmt, args...) debug(3, "[alive]: " fmt, ##args)
+#define DBWARN(fmt, args...) debug(1, "[alive]: " fmt, ##args)
+#define DBSTAT(fmt, args...) debug(1, "[stat]: " fmt, ##args)
+
+/* the keepalives of the current tunnel */
+static unsigned int seq;	/* of the last one sent */
+static unsigned int acked;	/* the last one answered */
+static unsigned int misses;	/* in a row */
+static int answers;		/* the far side echoes keepalives */
+static int heard;		/* payloads came since the last interval */
+static unsigned int rto;	/* the last one had this long (ms) */
+/* smoothed rtt and its mean deviation (us); 0 before the first answer */
+static unsigned long srtt, rttvar;
+
+/* over all tunnels */
+static struct {
+	unsigned long sent;
+	unsigned long skipped;	/* there was traffic */
+	unsigned long answered;
+	unsigned long missed;
+	unsigned long dead;	/* tunnels closed for missing them */
+	unsigned long last;	/* the last rtt (us) */
+} keepalives;
+
+/* the clock of the STAMPs: microseconds, wrapping every 71 minutes */
+static unsigned int stamp_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void send_alive(struct channel *channel, unsigned int command,
+		       unsigned int num, unsigned int stamp)
+{
+	static pbuffer *frame;
+	struct forward_header fh;
+
+	if (!frame)
+		frame = pbuffer_init();
+	pbuffer_clear(frame);
+	memset(&fh, 0, sizeof(fh));
+	fh.command = command;
+	fh.arg = num;
+	fh.stamp = stamp;
+	tlv_generate_frame(&fh, 0, frame);
+	egress_control(channel, frame->data, frame->length);
+}
+
+/* how long the answer to a keepalive may take (ms) */
+static unsigned int alive_rto(void)
+{
+	unsigned long ms;
+
+	if (!srtt)
+		return KEEPALIVE_INTERVAL;
+	ms = (srtt + 4 * rttvar) / 1000;
+	if (ms < KEEPALIVE_RTO_MIN)
+		return KEEPALIVE_RTO_MIN;
+	if (ms > KEEPALIVE_INTERVAL)
+		return KEEPALIVE_INTERVAL;
+	return ms;
+}
+
+static int keep_alive(struct timer *, uint64_t );
+
+/* the answer to the last keepalive is due */
+static int alive_due(struct timer *timer, uint64_t now)
+{
+	struct channel *channel = timer->channel;
+
+	if (acked != seq && !heard) {
+		misses++;
+		keepalives.missed++;
+		DB("Keepalive %u was not answered in %u ms (%u in a row)",
+		   seq, rto, misses);
+		if (answers && settings.keepalive_miss &&
+		    misses >= settings.keepalive_miss) {
+			DBWARN("The tunnel missed %u keepalives; closing",
+			       misses);
+			keepalives.dead++;
+			channel_kill(channel);
+			return 0;
+		}
+	}
+	if (rto < KEEPALIVE_INTERVAL)
+		timer_arm(timer, KEEPALIVE_INTERVAL - rto, keep_alive);
+	else
+		keep_alive(timer, now);
+	return 0;
+}
+
+static int keep_alive(struct timer *timer, uint64_t now)
+{
+	struct channel *channel = timer->channel;
+
+	if (heard) {
+		heard = 0;
+		misses = 0;
+		acked = seq;
+		keepalives.skipped++;
+		timer_arm(timer, KEEPALIVE_INTERVAL, keep_alive);
+		return 0;
+	}
+
+	DB("Sending keepalive %u", seq + 1);
+	send_alive(channel, CT_KEEPALIVE, ++seq, stamp_now());
+	keepalives.sent++;
+	rto = alive_rto();
+	timer_arm(timer, rto, alive_due);
+	return 0;
+}
+
+/* the channel is the tunnel from now on; it starts with a clean slate */
+void alive_attach(struct channel *channel)
+{
+	seq = acked = misses = 0;
+	answers = heard = 0;
+	srtt = rttvar = 0;
+	timer_arm(channel->timer, KEEPALIVE_INTERVAL, keep_alive);
+}
+
+/* the far side announced its features: it echoes keepalives */
+void alive_peer(unsigned int features)
+{
+	if (features & F_ALIVE)
+		answers = 1;
+}
+
+/* the far side sent a keepalive; echo it */
+void alive_reply(struct forward_header *fh)
+{
+	if (!tunnel->channel)
+		return;
+	send_alive(tunnel->channel, CT_ALIVE, fh->arg, fh->stamp);
+}
+
+/* the answer to one of our keepalives */
+void alive_echo(struct forward_header *fh)
+{
+	unsigned long rtt, dev;
+
+	answers = 1;
+	misses = 0;
+	/* answers to older ones still measure the rtt */
+	if ((int)(fh->arg - acked) > 0 && (int)(seq - fh->arg) >= 0)
+		acked = fh->arg;
+	keepalives.answered++;
+	if (!fh->stamp)
+		return;
+
+	rtt = (unsigned int)(stamp_now() - fh->stamp);
+	keepalives.last = rtt;
+	/* one that took longer than the interval waited out a stall of the
+	 * far side; it says nothing of the path */
+	if (rtt >= KEEPALIVE_INTERVAL * 1000UL)
+		return;
+	if (!srtt) {
+		srtt = rtt ? rtt : 1;
+		rttvar = rtt / 2;
+	} else {
+		dev = rtt > srtt ? rtt - srtt : srtt - rtt;
+		rttvar = (3 * rttvar + dev) / 4;
+		srtt = (7 * srtt + rtt) / 8;
+	}
+	DB("Keepalive %u took %lu us (srtt %lu, rttvar %lu)", fh->arg, rtt,
+	   srtt, rttvar);
+}
+
+/* a payload came from the tunnel */
+void alive_heard(void)
+{
+	heard = 1;
+}
+
+void alive_stats(void)
+{
+	DBSTAT("keepalives: %lu sent, %lu skipped, %lu answered, %lu missed, "
+	       "%lu dead", keepalives.sent, keepalives.skipped,
+	       keepalives.answered, keepalives.missed, keepalives.dead);
+	DBSTAT("tunnel rtt: %lu us, srtt %lu us, rttvar %lu us, %u missed "
+	       "in a row", keepalives.last, srtt, rttvar, misses);
+}
@@ -0,0 +1,36 @@
+#ifndef ALIVE_H
+#define ALIVE_H
+
+#include "channels.h"
+#include "forward.h"
+
+/* Every KEEPALIVE_INTERVAL a CT_KEEPALIVE goes over the tunnel with a
+ * sequence number and a STAMP of when it was sent; the far side echoes both
+ * back as CT_ALIVE, so the round trip time of the tunnel is measured
+ * without keeping anything for the keepalives in flight. The rtt is
+ * smoothed as TCP does (RFC 6298): srtt, and rttvar as its jitter. No
+ * keepalive is sent for an interval in which payloads came from the tunnel,
+ * as those show well enough that the far side is there. A keepalive that
+ * has no answer within the retransmission timeout of the measured rtt,
+ * srtt + 4 * rttvar, is missed; after settings.keepalive_miss misses in a
+ * row the tunnel is taken for dead and closed (one we connected connects
+ * again). Before the first answer the timeout is the interval. Only peers
+ * that announce F_ALIVE, or that answered, are held to that: older ones
+ * do not echo keepalives. */
+
+/* between keepalives on the tunnel (ms) */
+#define KEEPALIVE_INTERVAL 5000
+/* bounds of the time an answer may take (ms); as RFC 6298, the least is
+ * a second, and the most is the interval */
+#define KEEPALIVE_RTO_MIN 1000
+/* default number of missed keepalives that closes the tunnel */
+#define KEEPALIVE_MISS 3
+
+void alive_attach(struct channel *);
+void alive_reply(struct forward_header *);
+void alive_echo(struct forward_header *);
+void alive_peer(unsigned int );
+void alive_heard(void);
+void alive_stats(void);
+
+#endif /* ALIVE_H */
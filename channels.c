@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -6,18 +7,43 @@
 #include <netinet/in.h>
 #include <string.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <time.h>
 #include "channels.h"
 #include "list.h"
 #include "logging.h"
 #include "forward.h"
-
-struct pollfd pf[MAX_CONN];
-struct channel *channel_of_pf[MAX_CONN];
+#include "stats.h"
+#include "tags.h"
+#include "egress.h"
+#include "sessions.h"
+
+#ifdef USE_POLL
+/* poll() is level triggered; readiness is reported as long as it lasts */
+#define EV_EDGE 0
+struct pollfd *pf;
+#else
+/* epoll is edge triggered; we keep going until the kernel says EAGAIN */
+#define EV_EDGE 1
+static int epfd = -1;
+#endif
 struct channel *deque, *ready;
 uint nfds;
 unsigned int idle;
 
+/* Table of all channels. A channel keeps its index for as long as it lives,
+ * so the table (and pf[] along with it) can grow without invalidating
+ * anything. Slots of closed channels are handed out again. */
+static struct channel **chantab;
+static uint *freeslots;
+static uint nfree;
+static uint tabsize;
+static uint tabused;
+
+/* hard limit on the number of channels (0 = not set) */
+static uint max_conn;
+
 #define DB(fmt, args...) debug(3, "[chan]: " fmt, ##args)
 #define DBINFO(fmt, args...) debug(2, "[chan]: " fmt, ##args)
 #define DBWARN(fmt, args...) debug(1, "[chan]: " fmt, ##args)
@@ -57,192 +83,1061 @@ static void set_port(struct channel *channel, uint16_t port)
 		channel->v4.sin_port = htons(port);
 }
 
-static int udp_recv(struct channel *channel)
+static int set_nonblock(int fd)
 {
-	size_t bytes = 0;
-	pbuffer *b = channel->recv_buffer;
-	struct sockaddr *src;
-	socklen_t len;
+	int f_opt;
+
+	f_opt = fcntl(fd, F_GETFL, 0);
+	f_opt |= O_NONBLOCK;
+	if (fcntl(fd, F_SETFL, f_opt)) {
+		perror("fcntl()");
+		return -1;
+	}
+	return 0;
+}
+
+static int chantab_grow(void)
+{
+	uint size = tabsize ? tabsize * 2 : CHANTAB_MIN;
+	struct channel **tab;
+	uint *slots;
+#ifdef USE_POLL
+	struct pollfd *p;
+	uint i;
+
+	if (!(p = realloc(pf, size * sizeof(struct pollfd))))
+		return -1;
+	pf = p;
+	/* no socket in the new slots, until ev_attach() */
+	for (i = tabsize; i < size; i++) {
+		pf[i].fd = -1;
+		pf[i].events = 0;
+		pf[i].revents = 0;
+	}
+#endif
+	if (!(tab = realloc(chantab, size * sizeof(struct channel *))))
+		return -1;
+	chantab = tab;
+	if (!(slots = realloc(freeslots, size * sizeof(uint))))
+		return -1;
+	freeslots = slots;
+
+	DB("Channel table grown to %u slots", size);
+	tabsize = size;
+	return 0;
+}
+
+static int chantab_add(struct channel *channel)
+{
+	uint i;
+
+	if (max_conn && nfds >= max_conn) {
+		DBERR("Channel limit (%u) reached", max_conn);
+		return -1;
+	}
 
-	channel->src.af = channel->af;
-	src = psockaddr_saddr(&channel->src);
-	len = psockaddr_len(&channel->src);
-
-	/* stretch buffer to encompass message */
-	while ((bytes = recvfrom(channel->fd, pbuffer_end(b), pbuffer_unused(b),
-				 MSG_PEEK,
-				 src,
-				 &len)) >= pbuffer_unused(b)) {
-		if (bytes == -1) {
-			perror("recvfrom()");
+	if (nfree) {
+		i = freeslots[--nfree];
+	} else {
+		if (tabused == tabsize && chantab_grow() < 0) {
+			DBERR("Cannot grow channel table");
 			return -1;
 		}
-		pbuffer_assure(b, (bytes * 2) | PBUFFER_MIN);
+		i = tabused++;
+	}
+
+	chantab[i] = channel;
+	channel->index = i;
+#ifdef USE_POLL
+	/* a connecter may have no socket yet */
+	pf[i].fd = -1;
+	pf[i].events = 0;
+	pf[i].revents = 0;
+#endif
+	nfds++;
+	return 0;
+}
+
+static void chantab_del(struct channel *channel)
+{
+	chantab[channel->index] = NULL;
+	freeslots[nfree++] = channel->index;
+	nfds--;
+}
+
+/* A channel keeps its slot in the table while it has no socket (between
+ * connects); only the socket comes and goes */
+#ifdef USE_POLL
+static int ev_attach(struct channel *channel)
+{
+	pf[channel->index].fd = channel->fd;
+	pf[channel->index].events = channel->events;
+	pf[channel->index].revents = 0;
+	return 0;
+}
+
+static void ev_detach(struct channel *channel)
+{
+	pf[channel->index].fd = -1;
+	pf[channel->index].revents = 0;
+}
+
+static void ev_update(struct channel *channel)
+{
+	pf[channel->index].events = channel->events;
+}
+#else
+static int ev_attach(struct channel *channel)
+{
+	struct epoll_event ev;
+
+	/* Register for everything once; interest in channel->events is
+	 * applied when the event comes in. */
+	ev.events = EV_ALL | EPOLLET;
+	ev.data.ptr = channel;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, channel->fd, &ev) < 0) {
+		perror("epoll_ctl()");
+		return -1;
+	}
+	return 0;
+}
+
+static void ev_detach(struct channel *channel)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, channel->fd, NULL);
+}
+
+static void ev_update(struct channel *channel)
+{
+}
+#endif
+
+static int ev_register(struct channel *channel)
+{
+	if (chantab_add(channel) < 0)
+		return -1;
+	if (ev_attach(channel) < 0) {
+		chantab_del(channel);
+		return -1;
+	}
+	return 0;
+}
+
+static void ev_unregister(struct channel *channel)
+{
+	if (channel->fd >= 0)
+		ev_detach(channel);
+	chantab_del(channel);
+}
+
+/* Set the flags for the events and place the channel on the ready queue */
+static void channel_ready(struct channel *channel, int events)
+{
+	if (events & ~channel->events & EV_INPUT)
+		channel->flags |= CHAN_MISSED;
+	events &= (channel->events | EV_HUP);
+	if (!events)
+		return;
+
+	if (events & EV_HUP) {
+		channel->flags |= CHAN_CLOSE;
+	} else {
+		if (events & EV_INPUT)
+			channel->flags |= (channel->accept ? CHAN_ACCEPT : CHAN_RECV);
+		if (events & EV_OUTPUT)
+			channel->flags |= CHAN_SEND;
+	}
+
+	if (!list_is_linked(&channel->rlist))
+		list_append(ready->rlist.prev, &channel->rlist);
+}
+
+void channel_set_events(struct channel *channel, int events)
+{
+	int added = events & ~channel->events;
+
+	channel->events = events;
+	ev_update(channel);
+
+	/* The edge may have passed while we were not listening. Just try. */
+	if (EV_EDGE && added)
+		channel_ready(channel, added);
+}
+
+/* Stop reading from the channel until dest has drained its queue */
+static void channel_wait(struct channel *channel, struct channel *dest)
+{
+	if (list_is_linked(&channel->wlist))
+		return;
+
+	DB("fd%d waits for fd%d (%zu bytes queued)", channel->fd, dest->fd,
+	   channel_queued(dest));
+	list_append(dest->waiters.prev, &channel->wlist);
+	channel_set_events(channel, channel->events & ~EV_INPUT);
+}
+
+/* What the channel has waiting to go out through dest. On the tunnel
+ * that is also what its tag has queued for the tunnel. */
+static size_t channel_backlog(struct channel *channel, struct channel *dest)
+{
+	size_t queued = channel_queued(dest);
+
+	if (dest->flags & CHAN_TAGGED)
+		queued += egress_queued(channel->tagid);
+	return queued;
+}
+
+/* Resume reading on the channels waiting for this one, once their
+ * backlog has drained; or all of them, when it goes away */
+static void channel_release(struct channel *dest, int all)
+{
+	struct channel *channel;
+	struct list *node, *next;
+
+	for (node = dest->waiters.next; node != &dest->waiters; node = next) {
+		next = node->next;
+		channel = waiter_of(node);
+		if (!all && channel_backlog(channel, dest) > settings.low_water)
+			continue;
+		DB("fd%d resumes reading", channel->fd);
+		list_unlink(&channel->wlist);
+		list_init(&channel->wlist);
+		/* a stream with a closed window stays stopped */
+		if (channel->stream && !channel->tx_window)
+			continue;
+		channel_set_events(channel, channel->events | EV_INPUT);
+	}
+}
+
+/* channels that stopped reading at the memory cap */
+static struct list memwaiters = { &memwaiters, &memwaiters };
+
+/* Stop reading from the channel until its recv_buffer can grow by enough
+ * to take want more bytes under the memory cap; the socket pushes back on
+ * the sender meanwhile. Returns -1 when it would not fit even if all
+ * other buffers were freed. */
+static int channel_memwait(struct channel *channel, size_t want)
+{
+	pbuffer *b = channel->recv_buffer;
+	size_t size = b->allocated * 2;
+
+	while (size < b->length + want)
+		size *= 2;
+	if (size > pbuffer_pool.cap)
+		return -1;
+	channel->rx_need = size - b->allocated;
+	channel->flags &= ~CHAN_RECV;
+	channel_set_events(channel, channel->events & ~EV_INPUT);
+	if (channel->flags & CHAN_MEMWAIT)
+		return 0;
+	DB("fd%d waits for %zu bytes of buffer memory", channel->fd,
+	   channel->rx_need);
+	channel->flags |= CHAN_MEMWAIT;
+	list_append(memwaiters.prev, &channel->mlist);
+	stats.memwaits++;
+	return 0;
+}
+
+/* Resume the channels that wait for memory once their buffer fits. Like
+ * channel_release(), a channel that also waits for something else stays
+ * stopped. */
+static void memwait_check(void)
+{
+	struct channel *channel;
+	struct list *node, *next;
+
+	for (node = memwaiters.next; node != &memwaiters; node = next) {
+		next = node->next;
+		channel = memwaiter_of(node);
+		if (pbuffer_pool.live + channel->rx_need > pbuffer_pool.cap)
+			continue;
+		channel->flags &= ~CHAN_MEMWAIT;
+		list_unlink(&channel->mlist);
+		list_init(&channel->mlist);
+		DB("fd%d resumes reading", channel->fd);
+		if (list_is_linked(&channel->wlist) ||
+		    (channel->stream && !channel->tx_window))
+			continue;
+		channel_set_events(channel, channel->events | EV_INPUT);
+	}
+}
+
+void queue_send(struct channel *channel)
+{
+	if (!(channel->events & EV_OUTPUT))
+		channel_set_events(channel, channel->events | EV_OUTPUT);
+}
+
+/* Give the pieces to the kernel in one call, bypassing the queue.
+ * Returns how much it took, or -1 when the channel failed. */
+ssize_t channel_writev(struct channel *channel, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t ret;
+
+	if (channel->flags & (CHAN_CLOSE | CHAN_CONNECT))
+		return 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	stats.tx_calls++;
+	if ((ret = sendmsg(channel->fd, &msg, MSG_NOSIGNAL)) < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		perror("sendmsg");
+		channel_ready(channel, EV_HUP);
+		return -1;
+	}
+	stats.tx_bytes += ret;
+	if (ret && channel->idle_timeout)
+		channel->active = timer_now();
+	return ret;
+}
+
+/* The timeouts of the channel, on its timer: it is armed for the first
+ * deadline, and when that comes it checks whether there was traffic in
+ * the meantime. A stream that we stopped reading (it waits for the tunnel
+ * or for credit) is not idle; but one out of credit is, once no tunnel
+ * or far side is left to give it any. */
+static int channel_expire(struct timer *timer, uint64_t now)
+{
+	struct channel *channel = timer->channel;
+	uint64_t due = UINT64_MAX;
+
+	if (list_is_linked(&channel->wlist) ||
+	    (channel->stream && !channel->tx_window && stream_live(channel)))
+		channel->active = now;
+
+	if (channel->idle_timeout) {
+		if (now - channel->active >= channel->idle_timeout) {
+			DBINFO("fd%d is idle; closing", channel->fd);
+			stats.reaped_idle++;
+			channel_ready(channel, EV_HUP);
+			return 0;
+		}
+		due = channel->active + channel->idle_timeout;
 	}
+	if (channel->halfopen_timeout && (channel->flags & CHAN_EOF)) {
+		if (now - channel->shutdown >= channel->halfopen_timeout) {
+			DBINFO("fd%d does not drain; closing", channel->fd);
+			stats.reaped_halfopen++;
+			channel_ready(channel, EV_HUP);
+			return 0;
+		}
+		if (channel->shutdown + channel->halfopen_timeout < due)
+			due = channel->shutdown + channel->halfopen_timeout;
+	}
+	if (due != UINT64_MAX)
+		timer_arm(timer, due - now, channel_expire);
+	return 0;
+}
 
-	/* actually receive the message */
-	bytes = recvfrom(channel->fd, pbuffer_end(b), pbuffer_unused(b), 0,
-			 src, &len);
+/* Start the idle timeout of a new stream, when it has one */
+void channel_watch(struct channel *channel)
+{
+	/* the timer is the connect's until it is done */
+	if (channel->flags & CHAN_CONNECT)
+		return;
+	channel->active = timer_now();
+	if (channel->idle_timeout)
+		timer_arm(channel->timer, channel->idle_timeout,
+			  channel_expire);
+}
+
+/* Close the channel once everything queued on it has been sent */
+void channel_shutdown(struct channel *channel)
+{
+	struct timer *timer = channel->timer;
+
+	channel->flags |= CHAN_EOF;
+	if (!channel_queued(channel)) {
+		channel_ready(channel, EV_HUP);
+		return;
+	}
+	if (!channel->halfopen_timeout || (channel->flags & CHAN_CONNECT))
+		return;
+	channel->shutdown = timer_now();
+	if (!timer->armed || timer->expires > channel->shutdown +
+	    channel->halfopen_timeout)
+		timer_arm(timer, channel->halfopen_timeout, channel_expire);
+}
+
+/* Have the channel closed, dropping what is queued on it */
+void channel_kill(struct channel *channel)
+{
+	channel_ready(channel, EV_HUP);
+}
+
+/* Queue data to be sent on the channel. Datagrams keep their boundaries.
+ * A stream tries to send straight from the data when nothing is queued
+ * yet; what the kernel does not take is queued by reference to the
+ * storage of owner, or copied when there is no owner. A piece smaller than
+ * PCHAIN_SHARE is copied too, unless the storage is shared already. */
+int channel_queue(struct channel *channel, pbuffer *owner, void *data,
+		  size_t len)
+{
+	struct iovec iov = { data, len };
+	uint16_t dlen = len;
+	ssize_t ret = 0;
+
+	if (!channel->on_send) {
+		DB("fd%d cannot send; dropping %zu bytes", channel->fd, len);
+		return -1;
+	}
 
-	if (bytes == 0) {
-		channel->flags = CHAN_CLOSE;
+	if (channel->protocol != PROTO_UDP) {
+		if (!channel->send_chain->length &&
+		    (ret = channel_writev(channel, &iov, 1)) < 0)
+			return -1;
+		if (ret == len)
+			return 0;
+		if (owner && (owner->block || len - ret >= PCHAIN_SHARE))
+			pchain_add(channel->send_chain, owner, data + ret,
+				   len - ret);
+		else
+			pchain_copy(channel->send_chain, data + ret, len - ret);
+		queue_send(channel);
 		return 0;
 	}
-	b->length += bytes;
+
+	/* datagrams are copied, so they can go out in batches */
+	if (len > UDP_MAX) {
+		DBWARN("Datagram of %zu bytes too large", len);
+		return -1;
+	}
+	pbuffer_add(channel->send_buffer, &dlen, sizeof(dlen));
+	pbuffer_add(channel->send_buffer, data, len);
+	queue_send(channel);
+	return 0;
+}
+
+/* Update the running estimate of how much the channel delivers per event */
+static void rx_estimate(struct channel *channel, size_t bytes)
+{
+	size_t est = (channel->rx_estimate * 3 + bytes) / 4;
+
+	if (est < RECV_MIN)
+		est = RECV_MIN;
+	if (est > settings.recv_budget)
+		est = settings.recv_budget;
+	channel->rx_estimate = est;
+}
+
+/* Update the running estimate of how many datagrams the channel delivers
+ * per event. A full batch may have left more behind, so double it then. */
+static void rx_estimate_dgrams(struct channel *channel, int n, int batch)
+{
+	size_t est = (channel->rx_estimate * 3 + n + 3) / 4;
+
+	if (n == batch)
+		est = batch * 2;
+	if (est > (size_t)settings.udp_batch)
+		est = settings.udp_batch;
+	channel->rx_estimate = est;
+}
+
+/* Receive a batch of datagrams. Every datagram gets a slot in the
+ * recv_buffer that can hold the largest datagram, so there is no need to
+ * find out their size first; MSG_TRUNC only catches what should not
+ * happen. */
+static int udp_recv(struct channel *channel)
+{
+	struct mmsghdr msgs[UDP_BATCH_MAX];
+	struct iovec iov[UDP_BATCH_MAX];
+	pbuffer *b = channel->recv_buffer;
+	struct dgram *d = NULL;
+	int batch = channel->rx_estimate;
+	size_t total = 0;
+	int i, n;
+
+	stats.rx_events++;
+	/* near the memory cap, read fewer at a time; at it, stop reading
+	 * until one fits again, as tcp_recv() does */
+	while (pbuffer_reserve(b, batch * UDP_MAX) < 0) {
+		if (batch > 1) {
+			batch /= 2;
+			continue;
+		}
+		if (channel_memwait(channel, UDP_MAX) < 0) {
+			DBWARN("A datagram does not fit under the memory cap; "
+			       "closing fd%d", channel->fd);
+			channel->flags |= CHAN_CLOSE;
+		}
+		return -1;
+	}
+
+	for (i = 0; i < batch; i++) {
+		d = &channel->dgrams[i];
+		d->offset = b->length + i * UDP_MAX;
+		iov[i].iov_base = b->data + d->offset;
+		iov[i].iov_len = UDP_MAX;
+		memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+		msgs[i].msg_hdr.msg_name = &d->src.v6;
+		msgs[i].msg_hdr.msg_namelen = sizeof(d->src.v6);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	stats.rx_calls++;
+	if ((n = recvmmsg(channel->fd, msgs, batch, 0, NULL)) <= 0) {
+		/* an error (an ICMP error on a connected socket) is taken
+		 * off the socket by the call; wait for the next event */
+		if (n < 0 && errno != EAGAIN)
+			perror("recvmmsg()");
+		channel->flags &= ~CHAN_RECV;
+		return -1;
+	}
+
+	/* a short batch means the socket is drained */
+	if (n < batch)
+		channel->flags &= ~CHAN_RECV;
+	rx_estimate_dgrams(channel, n, batch);
+
+	for (i = 0; i < n; i++) {
+		d = &channel->dgrams[i];
+		d->length = msgs[i].msg_len;
+		d->src.af = d->src.v6.sin6_family;
+		if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			DBWARN("Datagram truncated to %zu bytes", d->length);
+		}
+		total += d->length;
+	}
+	channel->ndgrams = n;
+	b->length = d->offset + d->length;
+
+	channel->src = d->src;
 	addrstr(&channel->src);
+	stats.rx_bytes += total;
+	return total;
+}
+
+/* Send the queued datagrams, as many per call as the batch allows. Every
+ * datagram in the send_buffer is preceded by its length. */
+static int udp_send(struct channel *channel)
+{
+	struct mmsghdr msgs[UDP_BATCH_MAX];
+	struct iovec iov[UDP_BATCH_MAX];
+	pbuffer *b = channel->send_buffer;
+	unsigned char *p;
+	uint16_t len;
+	size_t bytes = 0;
+	int i, n, sent;
+
+	while (b->length) {
+		p = b->data;
+		for (n = 0; n < settings.udp_batch &&
+			     p < (unsigned char *)pbuffer_end(b); n++) {
+			memcpy(&len, p, sizeof(len));
+			iov[n].iov_base = p + sizeof(len);
+			iov[n].iov_len = len;
+			memset(&msgs[n].msg_hdr, 0, sizeof(struct msghdr));
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			p += sizeof(len) + len;
+		}
+
+		stats.tx_calls++;
+		if ((sent = sendmmsg(channel->fd, msgs, n, 0)) < 0) {
+			if (errno == EAGAIN)
+				break;
+			/* the first datagram cannot be sent; drop it */
+			perror("sendmmsg()");
+			sent = 1;
+		}
+
+		p = b->data;
+		for (i = 0; i < sent; i++) {
+			p += sizeof(len) + iov[i].iov_len;
+			bytes += iov[i].iov_len;
+		}
+		if (p == pbuffer_end(b))
+			pbuffer_clear(b);
+		else
+			pbuffer_shift(b, p - (unsigned char *)b->data);
+
+		if (sent < n)
+			break;
+	}
+
+	stats.tx_bytes += bytes;
 	return bytes;
 }
 
+/* Cut the pieces down to at most limit bytes; returns their size */
+static size_t iovec_limit(struct iovec *iov, int iovcnt, size_t limit)
+{
+	size_t total = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > limit - total)
+			iov[i].iov_len = limit - total;
+		total += iov[i].iov_len;
+	}
+	return total;
+}
+
+/* Read until the socket is drained, or the budget for this event is used
+ * up. The first read is sized from what the channel delivered on earlier
+ * events; a short read tells us there is nothing left. */
 static int tcp_recv(struct channel *channel)
 {
-	size_t bytes = 0;
+	struct iovec iov[2];
+	ssize_t bytes;
+	size_t want;
+	size_t total = 0;
+	size_t budget = settings.recv_budget;
 	pbuffer *b = channel->recv_buffer;
+	int n;
 
-	/* stretch buffer to encompass message */
-	while ((bytes = recv(channel->fd, pbuffer_end(b), pbuffer_unused(b),
-			     MSG_PEEK))
-	       >= pbuffer_unused(b)) {
-		if (bytes == -1) {
-			perror("recv()");
-			return -1;
+	/* a stream reads no more than its window allows */
+	if (channel->stream && budget > channel->tx_window)
+		budget = channel->tx_window;
+	if (!budget) {
+		channel->flags &= ~CHAN_RECV;
+		return -1;
+	}
+
+	stats.rx_events++;
+	want = channel->rx_estimate;
+	/* the tunnel reads big, and makes room for the frame it waits for */
+	if (channel->flags & CHAN_TAGGED) {
+		if (want < RECV_TUNNEL)
+			want = RECV_TUNNEL;
+		if (channel->rx_frame > b->length + want)
+			want = channel->rx_frame - b->length;
+	}
+	if (pbuffer_reserve(b, want) < 0 && !pbuffer_unused(b)) {
+		if (channel_memwait(channel, want) < 0) {
+			DBWARN("fd%d does not fit under the memory cap; "
+			       "closing", channel->fd);
+			channel->flags |= CHAN_CLOSE;
 		}
-		pbuffer_assure(b, (bytes * 2) | PBUFFER_MIN);
+		return -1;
 	}
 
-	/* actually receive the message */
-	bytes = recv(channel->fd, pbuffer_end(b), pbuffer_unused(b), 0);
-	if (bytes <= 0) {
-		channel->flags = CHAN_CLOSE;
-		return bytes;
+	while (total < budget) {
+		n = pbuffer_space_iov(b, iov);
+		want = iovec_limit(iov, n, budget - total);
+
+		stats.rx_calls++;
+		bytes = readv(channel->fd, iov, n);
+		if (bytes < 0) {
+			if (errno == EAGAIN) {
+				channel->flags &= ~(CHAN_RECV | CHAN_MISSED);
+				break;
+			}
+			perror("readv()");
+			channel->flags |= CHAN_CLOSE;
+			break;
+		}
+		if (bytes == 0) {
+			channel->flags |= CHAN_CLOSE;
+			channel->flags &= ~CHAN_RECV;
+			break;
+		}
+
+		b->length += bytes;
+		total += bytes;
+		/* a short read means the socket is drained, unless the edge
+		 * of an EOF that is still to be read was missed */
+		if (bytes < want && !(channel->flags & CHAN_MISSED)) {
+			channel->flags &= ~CHAN_RECV;
+			break;
+		}
+		if (!pbuffer_unused(b) &&
+		    pbuffer_reserve(b, b->allocated) < 0)
+			break;
 	}
-	b->length += bytes;
-	return bytes;
+
+	stats.rx_bytes += total;
+	rx_estimate(channel, total);
+	return total ? total : -1;
 }
 
+/* Send the send_chain, as many slices as fit in one call */
 static int tcp_send(struct channel *channel)
 {
-	int ret;
-	pbuffer *b = channel->send_buffer;
+	struct msghdr msg;
+	struct iovec iov[SEND_IOV];
+	ssize_t ret;
+	size_t offered;
+	pchain *chain = channel->send_chain;
 
-	if (!b || !b->length) {
+	if (!chain->length) {
 		return -1;
 	}
 
-	DB("sending %zu bytes", b->length);
-	hexdump(3, b->data, b->length);
-
-	if ((ret = send(channel->fd, b->data, b->length, 0)) < 0) {
-		perror("send");
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = pchain_data_iov(chain, iov, SEND_IOV);
+	offered = iovec_limit(iov, msg.msg_iovlen, chain->length);
+	DB("sending %zu bytes", chain->length);
+	hexdump_iov(3, iov, msg.msg_iovlen);
+
+	stats.tx_calls++;
+	if ((ret = sendmsg(channel->fd, &msg, MSG_NOSIGNAL |
+			   (channel->flags & CHAN_MORE ? MSG_MORE : 0))) < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		perror("sendmsg");
+		channel->flags |= CHAN_CLOSE;
 		return -1;
 	}
-	pbuffer_clear(b);
-	channel->flags &= ~CHAN_SEND;
+
+	stats.tx_bytes += ret;
+
+	/* keep whatever the kernel did not take for the next round; what it
+	 * took is released */
+	if (ret < chain->length)
+		DB("sent %zd bytes, %zu left", ret, chain->length - ret);
+	pchain_shift(chain, ret);
+	/* the kernel took all the slices of one call and has room for more:
+	 * no event will come for the rest, so it goes next round */
+	if (ret == offered && chain->length)
+		channel->flags |= CHAN_SEND;
+	else
+		channel->flags &= ~CHAN_SEND;
 
 	return ret;
 }
 
+/* The recv_buffer of a stream is a ring, so what waits in it for the
+ * tunnel is never moved back */
+static void tcp_buffers(struct channel *channel)
+{
+	pbuffer_ring(channel->recv_buffer);
+}
+
 static int channel_recv(struct channel *channel)
 {
 	int ret = 0;
 	pbuffer *b = channel->recv_buffer;
+	struct channel *out;
+	struct iovec iov[2];
+
+	/* input is blocked, or there is no connection yet; we will be
+	 * kicked once it is opened again */
+	if (!(channel->events & EV_INPUT) || (channel->flags & CHAN_CONNECT)) {
+		channel->flags &= ~CHAN_RECV;
+		return 0;
+	}
+
 	if (channel->on_recv) {
 		ret = channel->on_recv(channel);
+		if (ret > 0 && channel->idle_timeout)
+			channel->active = timer_now();
 		if (ret > 0) {
 			DB("received %u bytes from %s", ret,
 			   psockaddr_string(&channel->src));
-			hexdump(3, (unsigned char *)b->data, b->length);
-			forward_message(channel);
+			hexdump_iov(3, iov, pbuffer_data_iov(b, iov));
+		}
+		/* also pass on what was held back for a busy output */
+		if (ret > 0 || (ret < 0 && b->length)) {
+			out = forward_message(channel);
+			if (out && channel_backlog(channel, out) >
+			    settings.high_water)
+				channel_wait(channel, out);
 		}
 	} else {
 		DB("No callback");
 	}
 
-	channel->flags &= ~CHAN_RECV;
-	channel->pf->events |= EV_INPUT;
+	/* With edge triggered events we read until there is nothing left;
+	 * on_recv clears CHAN_RECV once the socket is drained. */
+	if (!EV_EDGE || !channel->on_recv)
+		channel->flags &= ~CHAN_RECV;
 
 	return ret;
 }
 
+static int connect_to(struct channel *channel)
+{
+	if (channel->af == AF_INET6)
+		return connect(channel->fd, (struct sockaddr *)&channel->v6,
+			       sizeof(channel->v6));
+	return connect(channel->fd, (struct sockaddr *)&channel->v4,
+		       sizeof(channel->v4));
+}
+
+/* where the channel connects to; a static buffer, for messages */
+static char *connect_peer(struct channel *channel)
+{
+	static char peer[INET6_ADDRSTRLEN + 8];
+	struct psockaddr psa = { .af = channel->af };
+
+	psa.v6 = channel->v6;
+	snprintf(peer, sizeof(peer), "%s:%u", addrstr(&psa),
+		 ntohs(channel->v4.sin_port));
+	return peer;
+}
+
+static int connect_retry(struct timer *, uint64_t );
+
+/* The connect failed: close the socket, and try again after the backoff,
+ * unless the channel made all the tries it may */
+static void connect_failed(struct channel *channel)
+{
+	unsigned int delay = CONNECT_BACKOFF;
+	unsigned int i;
+
+	if (channel->fd >= 0) {
+		ev_detach(channel);
+		close(channel->fd);
+		channel->fd = -1;
+	}
+	channel->flags |= CHAN_CONNECT;
+	channel->connect_failures++;
+	if (channel->connect_tries &&
+	    channel->connect_failures >= channel->connect_tries) {
+		DBWARN("Giving up on %s after %u connects",
+		       connect_peer(channel), channel->connect_failures);
+		stats.connect_failures++;
+		channel->flags &= ~CHAN_RECONNECT;
+		channel_ready(channel, EV_HUP);
+		return;
+	}
+
+	for (i = 1; i < channel->connect_failures &&
+		     delay < CONNECT_BACKOFF_MAX; i++)
+		delay *= 2;
+	if (delay > CONNECT_BACKOFF_MAX)
+		delay = CONNECT_BACKOFF_MAX;
+	delay += random() % (delay / 2 + 1);
+	DB("Connecting again in %u ms", delay);
+	stats.connect_retries++;
+	timer_arm(channel->timer, delay, connect_retry);
+}
+
+/* the connect did not complete in time */
+static int connect_expire(struct timer *timer, uint64_t now)
+{
+	DBWARN("Connect to %s timed out", connect_peer(timer->channel));
+	connect_failed(timer->channel);
+	return 0;
+}
+
+/* Start connecting a new socket for the channel; it waits for the result
+ * with EV_OUTPUT. Returns -1 when it failed at once. */
+static int connect_start(struct channel *channel)
+{
+	int type = channel->protocol == PROTO_TCP ? SOCK_STREAM : SOCK_DGRAM;
+
+	if ((channel->fd = socket(channel->af, type | SOCK_NONBLOCK, 0)) < 0) {
+		perror("socket()");
+		return -1;
+	}
+	if (connect_to(channel) < 0 && errno != EINPROGRESS) {
+		DBWARN("Could not connect to %s: %s", connect_peer(channel),
+		       strerror(errno));
+		close(channel->fd);
+		channel->fd = -1;
+		return -1;
+	}
+	channel->flags |= CHAN_CONNECT;
+	channel->events |= EV_OUTPUT;
+	if (ev_attach(channel) < 0) {
+		close(channel->fd);
+		channel->fd = -1;
+		return -1;
+	}
+	timer_arm(channel->timer, CONNECT_TIMEOUT, connect_expire);
+	return 0;
+}
+
+static int connect_retry(struct timer *timer, uint64_t now)
+{
+	struct channel *channel = timer->channel;
+
+	if (connect_start(channel) < 0)
+		connect_failed(channel);
+	return 0;
+}
+
+/* The connection of a CHAN_RECONNECT channel is lost: start over with
+ * nothing queued, and connect again as after a failed connect */
+static void connect_again(struct channel *channel)
+{
+	DBINFO("Lost the connection to %s; connecting again",
+	       connect_peer(channel));
+	pchain_clear(channel->send_chain);
+	pbuffer_clear(channel->recv_buffer);
+	channel->rx_frame = 0;
+	channel->flags &= CHAN_PERSIST | CHAN_RECONNECT;
+	channel->events = EV_INPUT;
+	channel->connect_failures = 0;
+	connect_failed(channel);
+}
+
+/* The socket of a connecting channel is writable, or has an error: see
+ * whether the connect is done. Returns -1 while it is not. */
+static int connect_done(struct channel *channel)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (channel->fd < 0)
+		return -1;
+	if (getsockopt(channel->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+	/* a second connect tells whether it is still under way */
+	if (!err && connect_to(channel) < 0 && errno != EISCONN)
+		err = errno;
+	if (err == EALREADY || err == EINPROGRESS)
+		return -1;
+	if (err) {
+		DBWARN("Could not connect to %s: %s", connect_peer(channel),
+		       strerror(err));
+		connect_failed(channel);
+		return -1;
+	}
+
+	DBINFO("fd%d connected to %s", channel->fd, connect_peer(channel));
+	channel->flags &= ~CHAN_CONNECT;
+	channel->connect_failures = 0;
+	timer_cancel(channel->timer);
+	stats.connects++;
+	if (channel->on_connect)
+		channel->on_connect(channel);
+	channel_watch(channel);
+	/* the far side closed the stream while we were connecting */
+	if (channel->flags & CHAN_EOF)
+		channel_shutdown(channel);
+	return 0;
+}
+
 static int channel_send(struct channel *channel)
 {
 	int ret = 0;
 	channel->flags &= ~CHAN_SEND;
-	channel->pf->events &= ~EV_OUTPUT;
+	if ((channel->flags & CHAN_CONNECT) && connect_done(channel) < 0)
+		return 0;
 	if (channel->on_send)
 		ret = channel->on_send(channel);
+	if (ret > 0 && channel->idle_timeout)
+		channel->active = timer_now();
+	if (ret > 0 && channel->on_sent)
+		channel->on_sent(channel);
+
+	/* keep waiting for output while there is still data pending */
+	if (channel_queued(channel))
+		channel->events |= EV_OUTPUT;
+	else
+		channel->events &= ~EV_OUTPUT;
+	ev_update(channel);
+
+	if (channel_queued(channel) <= settings.low_water)
+		channel_release(channel, 0);
+	if (!channel_queued(channel) && (channel->flags & CHAN_EOF))
+		channel->flags |= CHAN_CLOSE;
 	return ret;
 }
 
+static void channel_free(struct channel *channel)
+{
+	struct timer *timer = channel->timer;
+
+	timer_cancel(timer);
+	free(timer);
+	pbuffer_free(channel->recv_buffer);
+	pbuffer_free(channel->send_buffer);
+	pchain_free(channel->send_chain);
+	pbuffer_free(channel->prefix);
+	free(channel->dgrams);
+	free(channel);
+}
+
 static int channel_accept(struct channel *channel)
 {
 	socklen_t len;
-	struct channel *new = malloc(sizeof(struct channel));
-	struct sockaddr *src;
+	struct channel *new;
+	struct psockaddr src;
+	int fd;
 
 	DB("Accepting channel");
-	channel_init(new);
-	new->src.af = new->af = channel->af;
-	src = psockaddr_saddr(&new->src);
-	len = psockaddr_len(&new->src);
-	new->fd = accept(channel->fd, src, &len);
-
-	if (new->fd < 0) {
-		perror("accept()");
+	src.af = channel->af;
+	len = psockaddr_len(&src);
+	fd = accept4(channel->fd, psockaddr_saddr(&src), &len, SOCK_NONBLOCK);
+
+	if (fd < 0) {
+		if (errno != EAGAIN)
+			perror("accept()");
+		channel->flags &= ~CHAN_ACCEPT;
 		return -1;
 	}
 
+	if (max_conn && nfds >= max_conn) {
+		DBWARN("Channel limit (%u) reached; refusing %s", max_conn,
+		       addrstr(&src));
+		close(fd);
+		stats.refused++;
+		return 0;
+	}
+
+	new = malloc(sizeof(struct channel));
+	channel_init(new);
+	new->fd = fd;
+	new->af = channel->af;
+	new->src = src;
 	addrstr(&new->src);
 
 	DB("New fd is %d, connected address is %s", new->fd,
 	   psockaddr_string(&new->src));
-	channel->flags &= ~CHAN_ACCEPT;
+	if (!EV_EDGE)
+		channel->flags &= ~CHAN_ACCEPT;
 	new->flags = (channel->flags & CHAN_PERSIST);
+	new->protocol = channel->protocol;
 	strncpy(new->tag, channel->tag, MAX_TAG);
+	new->tagid = channel->tagid;
+	new->rx_window = channel->rx_window;
+	new->idle_timeout = channel->idle_timeout;
+	new->halfopen_timeout = channel->halfopen_timeout;
 	new->on_recv = tcp_recv;
 	new->on_send = tcp_send;
-	list_append(&channel->list, &new->list);
-	pf[nfds].fd = new->fd;
-	pf[nfds].events = EV_INPUT | EV_OUTPUT;
-	new->pf = &pf[nfds];
-	new->index = nfds;
-	channel_of_pf[nfds] = new;
-	nfds++;
-	return 0;
-}
-
-/* Remove the given pf, and move the last pf to the now empty slot */
-static void remove_pf(int index)
-{
-	int last = nfds - 1;
-	struct channel *channel;
-	if (index != last) {
-		pf[index].fd = pf[last].fd;
-		pf[index].events = pf[last].events;
-		pf[index].revents = pf[last].revents;
-		channel_of_pf[index] = channel_of_pf[last];
-		channel = channel_of_pf[index];
-		channel->index = index;
+	tcp_buffers(new);
+	new->events = EV_INPUT;
+	if (ev_register(new) < 0) {
+		close(new->fd);
+		channel_free(new);
+		return -1;
 	}
-	nfds--;
-	return;
-}
+	list_append(&channel->list, &new->list);
 
-static void channel_free(struct channel *channel)
-{
-	pbuffer_free(channel->recv_buffer);
-	pbuffer_free(channel->send_buffer);
-	free(channel);
+	if (channel->on_accept && channel->on_accept(new) < 0)
+		channel_ready(new, EV_HUP);
+	else
+		channel_watch(new);
+	return 0;
 }
 
 static int channel_close(struct channel *channel)
 {
-	int ret;
+	int ret = 0;
 	DB("Closing channel");
+	tag_unbind(channel);
+	channel_release(channel, 1);
+	if (list_is_linked(&channel->wlist)) {
+		list_unlink(&channel->wlist);
+		list_init(&channel->wlist);
+	}
+	if (channel->flags & CHAN_MEMWAIT) {
+		channel->flags &= ~CHAN_MEMWAIT;
+		list_unlink(&channel->mlist);
+		list_init(&channel->mlist);
+	}
 	if (channel->on_close)
 		ret = channel->on_close(channel);
-	close(channel->fd);
+	if (channel->flags & CHAN_RECONNECT) {
+		connect_again(channel);
+		return ret;
+	}
+	ev_unregister(channel);
+	if (channel->fd >= 0)
+		close(channel->fd);
 	list_unlink(&channel->list);
-	remove_pf(channel->index);
+	if (list_is_linked(&channel->rlist))
+		list_unlink(&channel->rlist);
 	channel_free(channel);
 	return ret;
 }
@@ -251,7 +1146,6 @@ static struct channel *new_listener(struct channel *deque, char *ip,
 			     uint16_t port, int mode)
 {
 	int new_sock = 0;
-	int f_opt;
 	int ret;
 
 	struct channel *channel = malloc(sizeof(struct channel));
@@ -265,12 +1159,8 @@ static struct channel *new_listener(struct channel *deque, char *ip,
 		return NULL;
 	}
 
-	f_opt = fcntl(new_sock, F_GETFL, 0);
-	f_opt |= O_NONBLOCK;
-	if (fcntl(new_sock, F_SETFL, f_opt)) {
-		perror("fcntl()");
+	if (set_nonblock(new_sock))
 		return NULL;
-	}
 
 	if (channel->af == AF_INET6) {
 		ret = bind(new_sock, (struct sockaddr *)&channel->v6,
@@ -285,16 +1175,12 @@ static struct channel *new_listener(struct channel *deque, char *ip,
 		return NULL;
 	}
 
-	list_append(&deque->list, &channel->list);
 	channel->fd = new_sock;
 	channel->flags = 0;
-	pf[nfds].fd = channel->fd;
-	pf[nfds].events = EV_INPUT | EV_OUTPUT;
-	pf[nfds].revents = 0;
-	channel_of_pf[nfds] = channel;
-	channel->pf = &pf[nfds];
-	channel->index = nfds;
-	nfds++;
+	channel->events = EV_INPUT;
+	if (ev_register(channel) < 0)
+		return NULL;
+	list_append(&deque->list, &channel->list);
 	return channel;
 }
 
@@ -307,6 +1193,8 @@ struct channel *new_udp_listener(struct channel *deque, char *ip, uint16_t port)
 	channel->protocol = PROTO_UDP;
 	channel->accept = 0;
 	channel->on_recv = udp_recv;
+	channel->dgrams = calloc(settings.udp_batch, sizeof(struct dgram));
+	channel->rx_estimate = 1;
 	return channel;
 }
 
@@ -317,7 +1205,7 @@ struct channel *new_tcp_listener(struct channel *deque, char *ip, uint16_t port)
 	if (!(channel = new_listener(deque, ip, port, SOCK_STREAM)))
 		return NULL;
 
-	if (listen(channel->fd, 0) < 0) {
+	if (listen(channel->fd, SOMAXCONN) < 0) {
 		perror("listen()");
 		return NULL;
 	}
@@ -327,68 +1215,56 @@ struct channel *new_tcp_listener(struct channel *deque, char *ip, uint16_t port)
 	return channel;
 }
 
+/* A channel that connects to ip and port. The connect does not block: what
+ * the channel is given is queued until it is done, and it is tried again
+ * when it fails (see CONNECT_BACKOFF). */
 struct channel *new_connecter(struct channel *deque, char *ip, uint16_t port,
 			      int mode)
 {
 	struct channel *channel = malloc(sizeof(struct channel));
-	int ret = 0;
-	int proto;
 
 	channel_init(channel);
 	set_ip(channel, ip);
 	set_port(channel, port);
+	channel->protocol = mode;
+	channel->fd = -1;
 
 	if (mode == PROTO_TCP) {
-		proto = SOCK_STREAM;
 		channel->on_recv = tcp_recv;
 		channel->on_send = tcp_send;
+		tcp_buffers(channel);
 	} else {
-		proto = SOCK_DGRAM;
 		channel->on_recv = udp_recv;
+		channel->on_send = udp_send;
+		channel->dgrams = calloc(settings.udp_batch,
+					 sizeof(struct dgram));
+		channel->rx_estimate = 1;
 	}
 
-	if ((ret = socket(channel->af, proto, 0)) == -1) {
-		perror("socket()");
+	if (chantab_add(channel) < 0) {
+		channel_free(channel);
 		return NULL;
 	}
-	channel->fd = ret;
-	if (channel->af == AF_INET6) {
-		ret = connect(channel->fd,
-			      (struct sockaddr *)&channel->v6,
-			      sizeof(struct sockaddr));
-	} else {
-		ret = connect(channel->fd,
-			      (struct sockaddr *)&channel->v4,
-			      sizeof(struct sockaddr));
-	}
-
-	if (ret < 0) {
-		perror("connect()");
-		return NULL;
-	}
-
+	channel->events = EV_INPUT;
 	list_append(&deque->list, &channel->list);
-	channel->flags = 0;
-	pf[nfds].fd = channel->fd;
-	pf[nfds].events = EV_INPUT | EV_OUTPUT;
-	pf[nfds].revents = 0;
-	channel_of_pf[nfds] = channel;
-	channel->pf = &pf[nfds];
-	channel->index = nfds;
-	nfds++;
+	if (connect_start(channel) < 0)
+		connect_failed(channel);
 	return channel;
 }
 
-/* Dispatch the ready queue and put channels back on the dequeue */
+/* Dispatch the ready queue. Channels that become ready while dispatching,
+ * or that still have work left, are handled in the next round. */
 int dispatch(struct channel *ready, struct channel *deque)
 {
 	struct channel *channel;
+	struct list pending;
 
-	while ((channel = channel_of(ready->list.next)) != ready) {
+	list_splice(&ready->rlist, &pending);
 
-		/* placing channel on deque */
-		list_unlink(&channel->list);
-		list_append(&deque->list, &channel->list);
+	while (pending.next != &pending) {
+		channel = ready_of(pending.next);
+		list_unlink(&channel->rlist);
+		list_init(&channel->rlist);
 
 		DB("fd%d flags: %02x", channel->fd, channel->flags);
 
@@ -403,66 +1279,166 @@ int dispatch(struct channel *ready, struct channel *deque)
 			channel_send(channel);
 		if (channel->flags & CHAN_RECV)
 			channel_recv(channel);
+
+		if ((channel->flags & CHAN_ALL) &&
+		    !list_is_linked(&channel->rlist))
+			list_append(ready->rlist.prev, &channel->rlist);
 	}
 	return 0;
 }
 
-/* Poll for events and place the channels with events on the ready queue */
-int poll_events(struct channel *deque, struct channel *ready)
+/* Events from the kernel. A connect ends with the socket writable, or with
+ * an error, which is not for closing the channel: connect_done() finds out
+ * which it was. */
+static void channel_event(struct channel *channel, int events)
+{
+	if ((channel->flags & CHAN_CONNECT) && (events & (EV_OUTPUT | EV_HUP)))
+		events = (events & EV_INPUT) | EV_OUTPUT;
+	channel_ready(channel, events);
+}
+
+#ifdef USE_POLL
+static int wait_events(int timeout)
+{
+	uint i;
+	int ret;
+	struct channel *channel;
+	struct pollfd *p;
+
+	if ((ret = poll(pf, tabused, timeout)) <= 0)
+		return ret;
+
+	for (i = 0; i < tabused; i++) {
+		p = &pf[i];
+		if (!p->revents || !(channel = chantab[i]))
+			continue;
+
+		DB("events for %d (fd %d): %d", i, p->fd, p->revents);
+		channel_event(channel, p->revents);
+	}
+	return ret;
+}
+#else
+static int wait_events(int timeout)
 {
 	int i;
 	int ret;
 	struct channel *channel;
+	struct epoll_event ev[EV_BATCH];
 
-	if(!pf[0].fd || nfds <= 0)
+	if ((ret = epoll_wait(epfd, ev, EV_BATCH, timeout)) <= 0)
+		return ret;
+
+	for (i = 0; i < ret; i++) {
+		channel = ev[i].data.ptr;
+		DB("events for fd %d: %d", channel->fd, ev[i].events);
+		channel_event(channel, ev[i].events);
+	}
+	return ret;
+}
+#endif
+
+/* Poll for events and place the channels with events on the ready queue */
+int poll_events(struct channel *deque, struct channel *ready)
+{
+	int ret;
+	int timeout;
+
+	if (nfds <= 0)
 		return 0;
 
-	ret = poll(pf, nfds, 1000);
+	/* what was sent in the last round may have freed buffers */
+	memwait_check();
+
+	/* don't sleep while there is still work to do, or past the first
+	 * timer or the time coalesced frames must go to the tunnel */
+	if (list_is_linked(&ready->rlist)) {
+		timeout = 0;
+	} else {
+		timeout = timer_next_deadline();
+		ret = egress_timeout();
+		if (ret >= 0 && (timeout < 0 || ret < timeout))
+			timeout = ret;
+	}
+
+	ret = wait_events(timeout);
+	if (ret < 0 && errno == EINTR)
+		ret = 0;
 
-	if (ret <= 0) {
+	if (ret == 0 && timeout) {
 		idle++;
 		DB("idle %d", idle);
-		goto end;
+	} else if (ret > 0) {
+		idle = 0;
 	}
 
-	for (i = 0; i < nfds; i++) {
-		idle = 0;
-		if (!pf[i].revents)
-			continue;
+	timer_check();
+	egress_check();
 
-		DB("events for %d (fd %d): %d", i, pf[i].fd, pf[i].revents);
+	return ret;
+}
 
-		if ((channel = channel_of_pf[i]) == NULL) {
-			DBWARN("Cannot find channel for fd %d", pf[i].fd);
-			continue;
-		}
+/* Set the maximum number of channels. Every channel needs a descriptor, so
+ * the limit is kept within (and if possible raises) RLIMIT_NOFILE. */
+int channel_limit(unsigned int max)
+{
+	struct rlimit rl;
+	rlim_t want;
 
-		DB("Found channel %p with fd: %d", channel, channel->fd);
-		list_unlink(&channel->list);
-		list_append(&ready->list, &channel->list);
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+		perror("getrlimit()");
+		max_conn = max;
+		return -1;
+	}
 
-		if (pf[i].revents & EV_HUP) {
-			channel->flags |= CHAN_CLOSE;
-			continue;
-		}
-		if (pf[i].revents & EV_INPUT)
-			channel->flags |= (channel->accept ? CHAN_ACCEPT : CHAN_RECV);
-		if (pf[i].revents & EV_OUTPUT)
-			channel->flags |= CHAN_SEND;
+	want = max ? (rlim_t)max + FD_RESERVE : rl.rlim_max;
+	if (rl.rlim_max != RLIM_INFINITY && want > rl.rlim_max)
+		want = rl.rlim_max;
+	if (want > rl.rlim_cur) {
+		rl.rlim_cur = want;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+			getrlimit(RLIMIT_NOFILE, &rl);
 	}
 
-end:
-	timer_check();
+	if (rl.rlim_cur != RLIM_INFINITY &&
+	    (!max || max + FD_RESERVE > rl.rlim_cur)) {
+		if (max)
+			DBWARN("Limiting channels to %lu (RLIMIT_NOFILE)",
+			       (unsigned long)(rl.rlim_cur - FD_RESERVE));
+		max = rl.rlim_cur - FD_RESERVE;
+	}
 
-	return ret;
+	max_conn = max;
+	DBINFO("Accepting up to %u channels", max_conn);
+	return 0;
+}
+
+int events_init(void)
+{
+	/* for the jitter of the connect backoff */
+	srandom(getpid() ^ time(NULL));
+#ifndef USE_POLL
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1()");
+		return -1;
+	}
+#endif
+	return 0;
 }
 
 void channel_init(struct channel *channel)
 {
-	bzero(&channel->v6, sizeof(struct sockaddr_in6));
+	memset(channel, 0, sizeof(struct channel));
 	list_init(&channel->list);
+	list_init(&channel->rlist);
+	list_init(&channel->waiters);
+	list_init(&channel->wlist);
+	list_init(&channel->mlist);
+	channel->rx_estimate = RECV_MIN;
 	channel->recv_buffer = pbuffer_init();
 	channel->send_buffer = pbuffer_init();
+	channel->send_chain = pchain_init();
+	channel->prefix = pbuffer_init();
 	channel->timer = timer_init();
 	channel->timer->channel = channel;
 }
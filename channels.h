@@ -4,15 +4,42 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <poll.h>
 #include <stdio.h>
+#include <string.h>
+#ifdef USE_POLL
+#include <poll.h>
+#else
+#include <sys/epoll.h>
+#endif
 
 #include "pbuffer.h"
 #include "list.h"
 #include "conf.h"
 #include "timer.h"
 
-#define MAX_CONN 100
+/* initial size of the channel table */
+#define CHANTAB_MIN 64
+/* descriptors kept free for things other than channels */
+#define FD_RESERVE 16
+
+/* smallest read we do on a stream, and the largest datagram */
+#define RECV_MIN 2048
+/* the tunnel reads at least this much at a time */
+#define RECV_TUNNEL (64 * 1024)
+#define UDP_MAX 65535
+
+/* A connect that fails, or takes longer than CONNECT_TIMEOUT, is tried
+ * again after CONNECT_BACKOFF, doubling up to CONNECT_BACKOFF_MAX, and up
+ * to half as much again at random, so outputs that failed together do not
+ * all come back together (ms). A stream gives up after CONNECT_TRIES. */
+#define CONNECT_TIMEOUT 10000
+#define CONNECT_BACKOFF 100
+#define CONNECT_BACKOFF_MAX 30000
+#define CONNECT_TRIES 5
+/* most datagrams taken from or given to the kernel in one call */
+#define UDP_BATCH_MAX 64
+/* most slices of the send_chain given to the kernel in one call */
+#define SEND_IOV 64
 
 #define PROTO_TCP 1
 #define PROTO_UDP 2
@@ -24,10 +51,31 @@
 #define CHAN_ALL (CHAN_CLOSE|CHAN_ACCEPT|CHAN_RECV|CHAN_SEND)
 #define CHAN_TAGGED 0x10
 #define CHAN_PERSIST (CHAN_TAGGED)
+/* close once everything queued has been sent */
+#define CHAN_EOF 0x20
+/* an input edge came while we were not reading; read until EAGAIN */
+#define CHAN_MISSED 0x40
+/* more data follows what is queued shortly (MSG_MORE) */
+#define CHAN_MORE 0x80
+/* a connect is under way, or waits to be tried again */
+#define CHAN_CONNECT 0x100
+/* stopped reading at the memory cap, until buffers are freed */
+#define CHAN_MEMWAIT 0x200
+/* a connecter that is not closed when its connection is lost, but
+ * connects again after the backoff */
+#define CHAN_RECONNECT 0x400
 
+#ifdef USE_POLL
 #define EV_HUP (POLLHUP)
 #define EV_INPUT (POLLIN)
 #define EV_OUTPUT (POLLOUT)
+#else
+#define EV_HUP (EPOLLHUP|EPOLLERR)
+#define EV_INPUT (EPOLLIN)
+#define EV_OUTPUT (EPOLLOUT)
+/* maximum number of events taken from the kernel per poll_events() */
+#define EV_BATCH 64
+#endif
 #define EV_ALL (EV_HUP|EV_INPUT|EV_OUTPUT)
 
 union uaddr {
@@ -45,6 +93,13 @@ struct psockaddr {
 	char addrstr[INET6_ADDRSTRLEN];
 };
 
+/* a datagram received in a batch; the data is in the recv_buffer */
+struct dgram {
+	size_t offset;
+	size_t length;
+	struct psockaddr src;
+};
+
 struct channel {
 	int fd;
 	int af;
@@ -53,6 +108,33 @@ struct channel {
 	int accept;
 	int index;
 	char tag[MAX_TAG];
+	int tagid;
+	unsigned int stream;
+
+	/* flow control of the stream: what we may still send over the
+	 * tunnel, the window we grant the far side, and what it sent us
+	 * that we have not given credit for yet */
+	size_t tx_window;
+	size_t rx_window;
+	size_t rx_credit;
+
+	/* close the stream after idle_timeout without traffic, or
+	 * halfopen_timeout after the far side closed it if its queue does
+	 * not drain (ms, 0 is never); when it last had traffic, and when
+	 * the far side closed it */
+	unsigned int idle_timeout;
+	unsigned int halfopen_timeout;
+	uint64_t active;
+	uint64_t shutdown;
+
+	/* connects that failed in a row, and how many it may make before
+	 * it gives up (0 is never) */
+	unsigned int connect_failures;
+	unsigned int connect_tries;
+
+	/* frames not to try to compress, after compressing did not pay */
+	unsigned int zskip;
+	unsigned int zbackoff;
 
 	union {
 		struct sockaddr_in v4;
@@ -61,41 +143,87 @@ struct channel {
 	struct psockaddr src;
 
 	struct list list;
+	struct list rlist;
+
+	/* channels waiting for our queue to drain, and our place on
+	 * such a list when we are the one waiting */
+	struct list waiters;
+	struct list wlist;
+	/* our place among the channels stopped at the memory cap */
+	struct list mlist;
 
 	char *name;
 
-	struct pollfd *pf;
+	/* events we are interested in (EV_*) */
+	int events;
 
 	struct timer *timer;
 
 	/* callback */
 	int (*on_accept)(struct channel *);
+	int (*on_connect)(struct channel *);
 	int (*on_recv)(struct channel *);
 	int (*on_send)(struct channel *);
 	int (*on_close)(struct channel *);
+	int (*on_sent)(struct channel *);
 
 	pbuffer *recv_buffer;
+	/* what waits to be sent: datagrams (UDP) in the send_buffer, the
+	 * data of a stream (TCP) in the send_chain */
 	pbuffer *send_buffer;
+	pchain *send_chain;
+
+	/* the encoded start of our frames on the tunnel (TAG, PROTOCOL,
+	 * STREAM and SRC), and the source it was made for */
+	pbuffer *prefix;
+	struct psockaddr prefix_src;
+
+	/* running estimate of the bytes (udp: datagrams) received per event */
+	size_t rx_estimate;
+	/* size of the frame the tunnel is still receiving, if known */
+	size_t rx_frame;
+	/* how much the recv_buffer must grow before it is read again, when
+	 * it stopped at the memory cap */
+	size_t rx_need;
+
+	/* datagrams of the last batch (UDP only) */
+	struct dgram *dgrams;
+	int ndgrams;
 };
 
 extern struct channel *deque, *ready;
 
 #define channel_of(ptr) containerof(ptr, struct channel, list)
 
+#define ready_of(ptr) containerof(ptr, struct channel, rlist)
+#define waiter_of(ptr) containerof(ptr, struct channel, wlist)
+#define memwaiter_of(ptr) containerof(ptr, struct channel, mlist)
+
 #define for_each_channel(deque, ptr) for (ptr = channel_of(deque->list.next); \
 					  ptr != deque; \
 					  ptr = channel_of(ptr->list.next))
 
 #define DISPATCHER while(poll_events(deque,ready)>=0){dispatch(ready, deque);}
 
+/* Note: returns a static buffer, for use in debug messages */
 static inline char *psockaddr_string(struct psockaddr *psock)
 {
-	char *tmp = malloc(INET6_ADDRSTRLEN + 6);
-	snprintf(tmp, INET6_ADDRSTRLEN + 6, "%s:%d", psock->addrstr,
-		 psock->v6.sin6_port);
+	static char tmp[INET6_ADDRSTRLEN + 6];
+	snprintf(tmp, sizeof(tmp), "%s:%d", psock->addrstr,
+		 ntohs(psock->v6.sin6_port));
 	return tmp;
 }
 
+static inline int psockaddr_equal(struct psockaddr *a, struct psockaddr *b)
+{
+	if (a->af != b->af || a->v6.sin6_port != b->v6.sin6_port)
+		return 0;
+	if (a->af == AF_INET6)
+		return !memcmp(&a->v6.sin6_addr, &b->v6.sin6_addr,
+			       sizeof(a->v6.sin6_addr));
+	return a->v4.sin_addr.s_addr == b->v4.sin_addr.s_addr;
+}
+
 static inline struct sockaddr *psockaddr_saddr(struct psockaddr *psock)
 {
 	if (psock->af == AF_INET6)
@@ -112,9 +240,10 @@ static inline socklen_t psockaddr_len(struct psockaddr *psock)
 		return sizeof(psock->v4);
 }
 
-static inline void queue_send(struct channel *c)
+/* the bytes waiting to be sent on the channel */
+static inline size_t channel_queued(struct channel *channel)
 {
-	c->pf->events |= EV_OUTPUT;
+	return channel->send_buffer->length + channel->send_chain->length;
 }
 
 struct channel *new_udp_listener(struct channel *, char *, uint16_t );
@@ -123,10 +252,19 @@ struct channel *new_connecter(struct channel *, char *, uint16_t , int );
 struct channel *connecter(struct channel *, char *, uint16_t );
 
 char *addrstr(struct psockaddr *);
+void queue_send(struct channel *);
+int channel_queue(struct channel *, pbuffer *, void *, size_t );
+ssize_t channel_writev(struct channel *, struct iovec *, int );
+void channel_shutdown(struct channel *);
+void channel_kill(struct channel *);
+void channel_watch(struct channel *);
+void channel_set_events(struct channel *, int );
+int channel_limit(unsigned int );
 int dispatch(struct channel *, struct channel *);
 int poll_events(struct channel *, struct channel *);
 
 void channel_init(struct channel *);
+int events_init(void);
 
 static inline void channels_init(void)
 {
@@ -140,6 +278,7 @@ static inline void channels_init(void)
 
 	idle = 0;
 	nfds = 0;
+	events_init();
 }
 
 #endif /* CHANNELS_H */
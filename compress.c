@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include "compress.h"
+#include "tlv.h"
+#include "tags.h"
+#include "egress.h"
+#include "logging.h"
+
+#define DB(fmt, args...) debug(3, "[zlib]: " fmt, ##args)
+#define DBSTAT(fmt, args...) debug(1, "[stat]: " fmt, ##args)
+#define DBERR(fmt, args...) debug(1, "[zlib]: " fmt, ##args)
+
+/* what compression did for a tag */
+struct zstats {
+	unsigned long frames;	/* sent deflated */
+	unsigned long bytes_in;
+	unsigned long bytes_out;
+	unsigned long tried;	/* did not gain enough; sent as they were */
+	unsigned long skipped;	/* not tried because of earlier failures */
+	unsigned long cpu_ns;	/* spent in deflate */
+};
+
+static struct zstats *zstats;
+static int nzstats;
+/* the features the far side announced */
+static unsigned int peer;
+static z_stream zdef, zinf;
+static int zdef_ok, zinf_ok;
+
+static struct zstats *zstats_get(int id)
+{
+	if (id < 0)
+		id = 0;
+	if (id >= nzstats) {
+		zstats = realloc(zstats, (id + 1) * sizeof(*zstats));
+		memset(zstats + nzstats, 0,
+		       (id + 1 - nzstats) * sizeof(*zstats));
+		nzstats = id + 1;
+	}
+	return &zstats[id];
+}
+
+static unsigned long cpu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* tell the far side what we can take; sent whenever a tunnel comes up */
+void compress_attach(struct channel *channel)
+{
+	static pbuffer *frame;
+	struct forward_header fh;
+
+	if (!frame)
+		frame = pbuffer_init();
+	pbuffer_clear(frame);
+
+	memset(&fh, 0, sizeof(fh));
+	fh.command = CT_FEATURES;
+	fh.arg = F_ZLIB | F_ALIVE;
+	tlv_generate_frame(&fh, 0, frame);
+	egress_control(channel, frame->data, frame->length);
+}
+
+void compress_peer(unsigned int features)
+{
+	DB("The far side has features 0x%x", features);
+	peer = features;
+}
+
+/* the tunnel is gone; the next one announces its own features */
+void compress_reset(void)
+{
+	peer = 0;
+}
+
+/* Deflate the payload of a frame of the channel to the end of out.
+ * Returns the size of the deflated data, or -1 when the payload should be
+ * sent as it is. */
+ssize_t compress_payload(struct channel *channel, unsigned char *data,
+			 size_t len, pbuffer *out)
+{
+	struct zstats *zs;
+	unsigned long cpu;
+	size_t limit = len - len / COMPRESS_GAIN;
+	int ret;
+
+	if (!settings.compress || len < settings.compress ||
+	    !(peer & F_ZLIB))
+		return -1;
+
+	zs = zstats_get(channel->tagid);
+	if (channel->zskip) {
+		channel->zskip--;
+		zs->skipped++;
+		return -1;
+	}
+
+	if (!zdef_ok) {
+		if (deflateInit2(&zdef, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS,
+				 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			DBERR("Could not set up deflate; not compressing");
+			settings.compress = 0;
+			return -1;
+		}
+		zdef_ok = 1;
+	}
+
+	cpu = cpu_now();
+	pbuffer_assure(out, limit);
+	zdef.next_in = data;
+	zdef.avail_in = len;
+	zdef.next_out = pbuffer_end(out);
+	zdef.avail_out = limit;
+	ret = deflate(&zdef, Z_FINISH);
+	deflateReset(&zdef);
+	zs->cpu_ns += cpu_now() - cpu;
+
+	/* it did not fit in the limit: back off from this channel, longer
+	 * every time it fails in a row */
+	if (ret != Z_STREAM_END) {
+		zs->tried++;
+		channel->zbackoff = channel->zbackoff ?
+			channel->zbackoff * 2 : 1;
+		if (channel->zbackoff > COMPRESS_BACKOFF)
+			channel->zbackoff = COMPRESS_BACKOFF;
+		channel->zskip = channel->zbackoff;
+		return -1;
+	}
+
+	channel->zbackoff = 0;
+	zs->frames++;
+	zs->bytes_in += len;
+	len = limit - zdef.avail_out;
+	zs->bytes_out += len;
+	out->length += len;
+	return len;
+}
+
+/* Inflate a ZPAYLOAD of size bytes. Returns a static buffer, or NULL when
+ * the data is not what it claims to be. */
+pbuffer *expand_payload(unsigned int size, pbuffer *payload)
+{
+	static pbuffer *b;
+	int ret;
+
+	if (!b)
+		b = pbuffer_init();
+	pbuffer_clear(b);
+
+	if (size > FRAME_MAX)
+		return NULL;
+	if (!zinf_ok) {
+		if (inflateInit2(&zinf, -MAX_WBITS) != Z_OK)
+			return NULL;
+		zinf_ok = 1;
+	}
+
+	pbuffer_assure(b, size);
+	zinf.next_in = payload->data;
+	zinf.avail_in = payload->length;
+	zinf.next_out = b->data;
+	zinf.avail_out = size;
+	ret = inflate(&zinf, Z_FINISH);
+	inflateReset(&zinf);
+	if (ret != Z_STREAM_END || zinf.avail_out)
+		return NULL;
+	b->length = size;
+	return b;
+}
+
+void compress_stats(void)
+{
+	struct zstats *zs;
+	int id;
+
+	for (id = 0; id < nzstats; id++) {
+		zs = &zstats[id];
+		if (!zs->frames && !zs->tried && !zs->skipped)
+			continue;
+		DBSTAT("compress %s: %lu frames, %lu -> %lu bytes (saved %lu), "
+		       "%lu not worth it, %lu skipped, %lu us",
+		       id ? tag_name(id) : "-", zs->frames, zs->bytes_in,
+		       zs->bytes_out, zs->bytes_in - zs->bytes_out, zs->tried,
+		       zs->skipped, zs->cpu_ns / 1000);
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "channels.h"
+#include "pbuffer.h"
+
+/* Payloads of at least settings.compress bytes may go over the tunnel
+ * deflated, as a ZPAYLOAD: the length of the payload, then the raw
+ * deflate data. Only peers that announced F_ZLIB with CT_FEATURES when
+ * the tunnel came up get them, so old peers keep working. A payload is
+ * sent deflated only when that saves at least 1/COMPRESS_GAIN of it; a
+ * channel whose data does not compress (already compressed streams) is
+ * not tried again for a number of frames that doubles up to
+ * COMPRESS_BACKOFF each time. */
+
+/* features for CT_FEATURES */
+#define F_ZLIB 0x01
+/* echoes CT_KEEPALIVE (see alive.h) */
+#define F_ALIVE 0x02
+
+#define COMPRESS_GAIN 8
+#define COMPRESS_BACKOFF 64
+
+void compress_attach(struct channel *);
+void compress_peer(unsigned int );
+void compress_reset(void);
+ssize_t compress_payload(struct channel *, unsigned char *, size_t ,
+			 pbuffer *);
+pbuffer *expand_payload(unsigned int , pbuffer *);
+void compress_stats(void);
+
+#endif /* COMPRESS_H */
@@ -7,10 +7,25 @@
 #include "channels.h"
 #include "logging.h"
 #include "timer.h"
+#include "stats.h"
+#include "tags.h"
+#include "sessions.h"
+#include "egress.h"
+#include "compress.h"
+#include "alive.h"
 
 struct conf_input *deq_input;
 struct conf_output *deq_output;
 struct conf_tunnel *tunnel;
+struct conf_settings settings = {
+	.high_water = HIGH_WATER,
+	.low_water = LOW_WATER,
+	.recv_budget = RECV_BUDGET,
+	.udp_batch = UDP_BATCH,
+	.window = WINDOW,
+	.flush_delay = FLUSH_DELAY,
+	.keepalive_miss = KEEPALIVE_MISS,
+};
 extern struct channel *deque;
 extern int loglevel;
 
@@ -32,6 +47,13 @@ static char *protocol_str(int protocol)
 
 static int create_output(struct conf_output *output)
 {
+	/* every stream gets a connection of its own when it starts */
+	if (output->protocol == PROTO_TCP) {
+		DBINFO("TCP output %s:%u connects per stream, tag=%s",
+		       output->dst, output->dport, output->tag);
+		return 0;
+	}
+
 	DBINFO("Creating new %s output channel on %s:%u, tag=%s",
 	       protocol_str(output->protocol), output->dst,
 	       output->dport, output->tag);
@@ -40,6 +62,7 @@ static int create_output(struct conf_output *output)
 	if (!output->channel)
 		return -1;
 	strncpy(output->channel->tag, output->tag, MAX_TAG);
+	output->channel->tagid = output->tagid;
 	return 0;
 }
 
@@ -57,22 +80,77 @@ static int create_input(struct conf_input *input)
 	if (!input->channel)
 		return -1;
 	strncpy(input->channel->tag, input->tag, MAX_TAG);
+	input->channel->tagid = input->tagid;
+	input->channel->rx_window = input->opts.window;
+	input->channel->idle_timeout = input->opts.idle * 1000;
+	input->channel->halfopen_timeout = input->opts.halfopen * 1000;
+	if (input->protocol == PROTO_TCP)
+		input->channel->on_accept = stream_open;
 	return 0;
 }
 
-static int tunnel_close(struct channel *channel)
+/* stop or resume reading from the inputs and outputs */
+static void block_channels(int block)
 {
 	struct conf_input *input;
 	struct conf_output *output;
+	struct channel *channel;
 
-	/* block both input and output channels */
 	for_each_input(deq_input, input) {
-		input->channel->pf->events &= ~EV_INPUT;
+		if ((channel = input->channel))
+			channel_set_events(channel, block ?
+					   channel->events & ~EV_INPUT :
+					   channel->events | EV_INPUT);
 	}
 
 	for_each_output(deq_output, output) {
-		output->channel->pf->events &= ~EV_INPUT;
+		if ((channel = output->channel))
+			channel_set_events(channel, block ?
+					   channel->events & ~EV_INPUT :
+					   channel->events | EV_INPUT);
+	}
+}
+
+/* The tunnel is gone. One we connected stays the tunnel: it connects
+ * again (CHAN_RECONNECT), and the inputs wait for it. */
+static int tunnel_close(struct channel *channel)
+{
+	if (channel == tunnel->channel && !tunnel->remote)
+		tunnel->channel = tunnel->listener;
+	egress_reset();
+	compress_reset();
+	sessions_reset();
+	block_channels(1);
+	return 0;
+}
+
+/* the far side connected to us; it carries the frames from now on */
+static int tunnel_accept(struct channel *channel)
+{
+	if (tunnel->channel != tunnel->listener) {
+		DBWARN("Already have a tunnel; refusing %s",
+		       psockaddr_string(&channel->src));
+		return -1;
 	}
+
+	DBINFO("Tunnel connected from %s", psockaddr_string(&channel->src));
+	tunnel->channel = channel;
+	channel->on_close = tunnel_close;
+	egress_attach(channel);
+	compress_attach(channel);
+	alive_attach(channel);
+	block_channels(0);
+	return 0;
+}
+
+/* the connect to the far side is done; what waited for it goes now */
+static int tunnel_connect(struct channel *channel)
+{
+	DBINFO("Tunnel connected to %s:%u", tunnel->ip, tunnel->port);
+	egress_socket(channel);
+	compress_attach(channel);
+	alive_attach(channel);
+	block_channels(0);
 	return 0;
 }
 
@@ -95,8 +173,15 @@ int create_tunnel(struct conf_tunnel *tunnel)
 		return -1;
 	}
 	tunnel->channel->flags |= CHAN_TAGGED;
-	tunnel->channel->on_close = tunnel_close;
-	timer_arm(tunnel->channel->timer, 5, keep_alive);
+	if (tunnel->remote) {
+		tunnel->channel->flags |= CHAN_RECONNECT;
+		tunnel->channel->on_connect = tunnel_connect;
+		tunnel->channel->on_close = tunnel_close;
+		egress_attach(tunnel->channel);
+	} else {
+		tunnel->listener = tunnel->channel;
+		tunnel->channel->on_accept = tunnel_accept;
+	}
 	return 0;
 }
 
@@ -115,7 +200,28 @@ int create_sockets(void)
 		return -1;
 	}
 
+	channel_limit(settings.max_conn);
+	pbuffer_pool.cap = settings.mem_cap;
+	if (settings.recv_budget < PBUFFER_MIN)
+		settings.recv_budget = PBUFFER_MIN;
+	if (settings.udp_batch < 1)
+		settings.udp_batch = 1;
+	if (settings.udp_batch > UDP_BATCH_MAX)
+		settings.udp_batch = UDP_BATCH_MAX;
+	if (settings.low_water > settings.high_water) {
+		DBWARN("lowwater is above highwater; using %zu",
+		       settings.high_water);
+		settings.low_water = settings.high_water;
+	}
+
 	for_each_output(deq_output, optr) {
+		if (!optr->opts.window)
+			optr->opts.window = settings.window;
+		if (!optr->opts.idle)
+			optr->opts.idle = settings.idle;
+		if (!optr->opts.halfopen)
+			optr->opts.halfopen = settings.halfopen;
+		egress_options(optr->tagid, &optr->opts);
 		ret = create_output(optr);
 	}
 
@@ -123,9 +229,33 @@ int create_sockets(void)
 		return -1;
 
 	for_each_input(deq_input, iptr) {
+		if (!iptr->opts.window)
+			iptr->opts.window = settings.window;
+		if (!iptr->opts.idle)
+			iptr->opts.idle = settings.idle;
+		if (!iptr->opts.halfopen)
+			iptr->opts.halfopen = settings.halfopen;
+		egress_options(iptr->tagid, &iptr->opts);
 		ret = create_input(iptr);
 	}
 
+	/* outputs take the frames for their tag; inputs only get those
+	 * for tags without an output */
+	tag_index_reset();
+	for_each_output(deq_output, optr) {
+		tag_bind_output(optr->tagid, optr);
+		if (optr->channel)
+			tag_bind(optr->tagid, optr->channel);
+	}
+	for_each_input(deq_input, iptr) {
+		if (iptr->channel && !tag_output(iptr->tagid))
+			tag_bind(iptr->tagid, iptr->channel);
+	}
+
+	if (settings.stats_interval > 0)
+		timer_arm(timer_init(), settings.stats_interval * 1000,
+			  stats_timer);
+
 	return ret;
 }
 
@@ -188,11 +318,43 @@ static int parse_protocol(char *line)
 	return 0;
 }
 
+/* the options after the tag: key=value or a flag, separated by commas */
+static int parse_options(char *line, struct conf_options *opts)
+{
+	char *value, *key;
+
+	while ((value = strsep(&line, ","))) {
+		key = strsep(&value, "=");
+		if (!strcmp(key, "nodelay")) {
+			opts->nodelay = 1;
+			continue;
+		}
+		if (!value) {
+			DBERR("Invalid option: %s", key);
+			return 1;
+		}
+
+		if (!strcmp(key, "window")) {
+			opts->window = strtoul(value, NULL, 10);
+		} else if (!strcmp(key, "weight")) {
+			opts->weight = atoi(value);
+		} else if (!strcmp(key, "idle")) {
+			opts->idle = strtoul(value, NULL, 10);
+		} else if (!strcmp(key, "halfopen")) {
+			opts->halfopen = strtoul(value, NULL, 10);
+		} else {
+			DBERR("Unknown option: %s", key);
+			return 1;
+		}
+	}
+	return 0;
+}
+
 static int parse_input(char *line)
 {
 	char *holder;
 	int ret = 0;
-	struct conf_input *new = malloc(sizeof(struct conf_input));
+	struct conf_input *new = calloc(1, sizeof(struct conf_input));
 	list_init(&new->list);
 
 	holder = strsep(&line, "=");
@@ -203,8 +365,14 @@ static int parse_input(char *line)
 	if (!(new->af = parse_ip_and_port(holder, new->ip, &new->port)))
 		ret = 2;
 
-	if (!strncpy(new->tag, line, MAX_TAG))
+	holder = strsep(&line, ",");
+	if (!holder || !strncpy(new->tag, holder, MAX_TAG))
 		ret = 3;
+	new->tag[MAX_TAG - 1] = '\0';
+	new->tagid = tag_intern(new->tag);
+
+	if (parse_options(line, &new->opts))
+		ret = 4;
 
 	if (ret) {
 		DBERR("Invalid input: %d", ret);
@@ -220,7 +388,7 @@ static int parse_output(char *line)
 {
 	char *holder;
 	int ret = 0;
-	struct conf_output *new = malloc(sizeof(struct conf_output));
+	struct conf_output *new = calloc(1, sizeof(struct conf_output));
 	list_init(&new->list);
 
 	holder = strsep(&line, "=");
@@ -233,9 +401,16 @@ static int parse_output(char *line)
 		ret = 2;
 	}
 
-	if (!strncpy(new->tag, line, MAX_TAG)) {
+	holder = strsep(&line, ",");
+	if (!holder || !strncpy(new->tag, holder, MAX_TAG)) {
 		ret = 3;
 	}
+	new->tag[MAX_TAG - 1] = '\0';
+	new->tagid = tag_intern(new->tag);
+
+	if (parse_options(line, &new->opts)) {
+		ret = 4;
+	}
 
 	if (ret) {
 		DBERR("Invalid output");
@@ -264,13 +439,58 @@ static int parse_tunnel(char *line)
 		DBERR("Unknown tunnel mode");
 		return -2;
 	}
-	tunnel = malloc(sizeof(struct conf_tunnel));
+	tunnel = calloc(1, sizeof(struct conf_tunnel));
 	tunnel->af = parse_ip_and_port(line, tunnel->ip, &tunnel->port);
 	tunnel->remote = remote;
 
 	return 0;
 }
 
+static int parse_setting(char *line)
+{
+	char *holder;
+
+	holder = strsep(&line, "=");
+	if (!line) {
+		DBERR("Invalid setting: %s", holder);
+		return 1;
+	}
+
+	if (!strcmp(holder, "maxconn")) {
+		settings.max_conn = strtoul(line, NULL, 10);
+	} else if (!strcmp(holder, "memcap")) {
+		settings.mem_cap = strtoul(line, NULL, 10);
+	} else if (!strcmp(holder, "highwater")) {
+		settings.high_water = strtoul(line, NULL, 10);
+	} else if (!strcmp(holder, "lowwater")) {
+		settings.low_water = strtoul(line, NULL, 10);
+	} else if (!strcmp(holder, "recvbudget")) {
+		settings.recv_budget = strtoul(line, NULL, 10);
+	} else if (!strcmp(holder, "udpbatch")) {
+		settings.udp_batch = atoi(line);
+	} else if (!strcmp(holder, "window")) {
+		settings.window = strtoul(line, NULL, 10);
+	} else if (!strcmp(holder, "idle")) {
+		settings.idle = strtoul(line, NULL, 10);
+	} else if (!strcmp(holder, "halfopen")) {
+		settings.halfopen = strtoul(line, NULL, 10);
+	} else if (!strcmp(holder, "coalesce")) {
+		settings.coalesce = strtoul(line, NULL, 10);
+	} else if (!strcmp(holder, "flushdelay")) {
+		settings.flush_delay = atol(line);
+	} else if (!strcmp(holder, "compress")) {
+		settings.compress = strtoul(line, NULL, 10);
+	} else if (!strcmp(holder, "keepalivemiss")) {
+		settings.keepalive_miss = strtoul(line, NULL, 10);
+	} else if (!strcmp(holder, "stats")) {
+		settings.stats_interval = atoi(line);
+	} else {
+		DBERR("Unknown setting: %s", holder);
+		return 1;
+	}
+	return 0;
+}
+
 static int parse_line(char *line, int section)
 {
 	switch (section) {
@@ -280,6 +500,8 @@ static int parse_line(char *line, int section)
 		return parse_output(line);
 	case CONF_TUNNEL:
 		return parse_tunnel(line);
+	case CONF_SETTINGS:
+		return parse_setting(line);
 	default:
 		return -1;
 	}
@@ -319,6 +541,10 @@ static int parse_file(char *filename)
 			section = CONF_TUNNEL;
 			continue;
 		}
+		if (!strcmp(line, "[settings]")) {
+			section = CONF_SETTINGS;
+			continue;
+		}
 
 		if (parse_line(line, section) < 0)
 			return -1;
@@ -11,6 +11,17 @@
 #define CONF_INPUT 1
 #define CONF_OUTPUT 2
 #define CONF_TUNNEL 3
+#define CONF_SETTINGS 4
+
+/* options that can follow the tag of an input or output */
+struct conf_options {
+	size_t window;		/* flow control window of each stream */
+	int weight;		/* share of the tunnel when it is busy */
+	int nodelay;		/* send frames at once, do not coalesce */
+	unsigned int idle;	/* close streams idle this long (s) */
+	unsigned int halfopen;	/* close streams this long after the far
+				 * side did, if they do not drain (s) */
+};
 
 struct conf_input {
 	char ip[INET6_ADDRSTRLEN];
@@ -18,6 +29,8 @@ struct conf_input {
 	int protocol;
 	int af;
 	char tag[MAX_TAG];
+	int tagid;
+	struct conf_options opts;
 	struct list list;
 	struct channel *channel;
 };
@@ -30,6 +43,8 @@ struct conf_output {
 	int protocol;
 	int af;
 	char tag[MAX_TAG];
+	int tagid;
+	struct conf_options opts;
 	struct list list;
 	struct channel *channel;
 };
@@ -39,9 +54,43 @@ struct conf_tunnel {
 	uint16_t port;
 	int af;
 	int remote;
+	/* the connection the frames go over, and (when we do not connect
+	 * to the far side) the listener it came from */
 	struct channel *channel;
+	struct channel *listener;
+};
+
+/* default watermarks for send buffers (bytes) */
+#define HIGH_WATER (256 * 1024)
+#define LOW_WATER (64 * 1024)
+/* default number of bytes read from a channel per event */
+#define RECV_BUDGET (256 * 1024)
+/* default number of datagrams received or sent per call */
+#define UDP_BATCH 16
+/* default flow control window of a stream (bytes) */
+#define WINDOW (256 * 1024)
+/* default deadline for coalesced frames (microseconds) */
+#define FLUSH_DELAY 500
+
+struct conf_settings {
+	unsigned int max_conn;
+	size_t mem_cap;
+	size_t high_water;
+	size_t low_water;
+	size_t recv_budget;
+	int udp_batch;
+	size_t window;
+	unsigned int idle;
+	unsigned int halfopen;
+	size_t coalesce;
+	long flush_delay;
+	size_t compress;
+	unsigned int keepalive_miss;
+	int stats_interval;
 };
 
+extern struct conf_settings settings;
+
 #define input_of(ptr) containerof(ptr, struct conf_input, list)
 
 #define for_each_input(deque, ptr) for(ptr = input_of(deque->list.next); \
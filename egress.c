@@ -0,0 +1,319 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "egress.h"
+#include "tlv.h"
+#include "logging.h"
+#include "stats.h"
+
+extern struct conf_tunnel *tunnel;
+
+#define DB(fmt, args...) debug(3, "[egrs]: " fmt, ##args)
+
+struct lane {
+	pchain *queue;		/* whole frames, in order */
+	size_t deficit;
+	int weight;
+	int turn;		/* got the quantum of its current turn */
+	int nodelay;
+	struct list list;	/* on the active list while it has frames */
+};
+
+#define lane_of(ptr) containerof(ptr, struct lane, list)
+
+/* lanes by tag id; id 0 is for frames without a tag */
+static struct lane **lanes;
+static int nlanes;
+static struct list active = { &active, &active };
+static pbuffer *control;
+/* bytes in all data lanes */
+static size_t queued;
+/* when the coalesced frames must go, if any are held */
+static struct timespec flush_at;
+static int flush_armed;
+
+static struct lane *lane_get(int id)
+{
+	struct lane *lane;
+
+	if (id < 0)
+		id = 0;
+	if (id >= nlanes) {
+		lanes = realloc(lanes, (id + 1) * sizeof(*lanes));
+		memset(lanes + nlanes, 0, (id + 1 - nlanes) * sizeof(*lanes));
+		nlanes = id + 1;
+	}
+	if (!(lane = lanes[id])) {
+		lane = lanes[id] = calloc(1, sizeof(struct lane));
+		lane->queue = pchain_init();
+		lane->weight = 1;
+		list_init(&lane->list);
+	}
+	return lane;
+}
+
+static void lane_add(struct lane *lane, pchain *frames)
+{
+	size_t len = frames->length;
+
+	if (!len)
+		return;
+	if (!list_is_linked(&lane->list))
+		list_append(active.prev, &lane->list);
+	pchain_move(lane->queue, frames, len);
+	queued += len;
+}
+
+/* the size of the frame at the start of the chain */
+static size_t frame_size(pchain *chain)
+{
+	unsigned char head[TORV_MAX];
+
+	return tlv_frame_size(head, pchain_peek(chain, head, TORV_MAX));
+}
+
+/* an idle lane does not save up its deficit */
+static void lane_idle(struct lane *lane)
+{
+	list_unlink(&lane->list);
+	list_init(&lane->list);
+	lane->deficit = 0;
+	lane->turn = 0;
+}
+
+/* Move frames to the send_chain of the tunnel until it holds
+ * EGRESS_BATCH bytes: all control frames, then the data lanes in turn.
+ * The frames of the lanes are moved, not copied. */
+static void egress_fill(struct channel *out)
+{
+	pchain *b = out->send_chain;
+	struct lane *lane;
+	size_t size;
+
+	if (control && control->length) {
+		pchain_copy(b, control->data, control->length);
+		pbuffer_clear(control);
+	}
+
+	while (b->length < EGRESS_BATCH && active.next != &active) {
+		lane = lane_of(active.next);
+		if (!lane->turn) {
+			lane->deficit += EGRESS_QUANTUM * lane->weight;
+			lane->turn = 1;
+		}
+
+		size = 0;
+		while (lane->queue->length && b->length < EGRESS_BATCH) {
+			size = frame_size(lane->queue);
+			if (size > lane->deficit)
+				break;
+			pchain_move(b, lane->queue, size);
+			lane->deficit -= size;
+			queued -= size;
+			size = 0;
+		}
+
+		if (!lane->queue->length) {
+			lane_idle(lane);
+		} else if (size) {
+			/* its turn is over; the next lane goes */
+			lane->turn = 0;
+			list_unlink(&lane->list);
+			list_append(active.prev, &lane->list);
+		}
+	}
+
+	/* whatever was held goes with this write */
+	if (!queued)
+		flush_armed = 0;
+	/* tell the kernel more is coming, so it does not push a short
+	 * segment at the end of this write */
+	if (queued)
+		out->flags |= CHAN_MORE;
+	else
+		out->flags &= ~CHAN_MORE;
+}
+
+/* the tunnel sent something (on_sent); top up its send_chain */
+static int egress_pull(struct channel *out)
+{
+	int drained = !out->send_chain->length;
+
+	if (out->send_chain->length >= EGRESS_BATCH)
+		return 0;
+	egress_fill(out);
+	/* the kernel took all we had, so it may well take more right away */
+	if (drained && out->send_chain->length)
+		out->flags |= CHAN_SEND;
+	return 0;
+}
+
+static void egress_flush(struct channel *out)
+{
+	if (!out->send_chain->length)
+		egress_fill(out);
+	if (out->send_chain->length)
+		queue_send(out);
+}
+
+/* Hold the frames that found the tunnel idle, until there are enough of
+ * them or the deadline passes */
+static void egress_hold(struct channel *out)
+{
+	if (out->send_chain->length)
+		return;
+	if (queued >= settings.coalesce) {
+		stats.flush_full++;
+		egress_flush(out);
+		return;
+	}
+	if (!flush_armed) {
+		clock_gettime(CLOCK_MONOTONIC, &flush_at);
+		flush_at.tv_nsec += settings.flush_delay * 1000;
+		flush_at.tv_sec += flush_at.tv_nsec / 1000000000;
+		flush_at.tv_nsec %= 1000000000;
+		flush_armed = 1;
+	}
+}
+
+/* the socket of the tunnel; set again when a new one connects */
+void egress_socket(struct channel *channel)
+{
+	int lowat = EGRESS_LOWAT;
+	int one = 1;
+
+	if (setsockopt(channel->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+		       sizeof(lowat)) < 0)
+		DB("Could not set TCP_NOTSENT_LOWAT on fd%d", channel->fd);
+	/* we coalesce ourselves; Nagle would only hold back a flush */
+	if (setsockopt(channel->fd, IPPROTO_TCP, TCP_NODELAY, &one,
+		       sizeof(one)) < 0)
+		DB("Could not set TCP_NODELAY on fd%d", channel->fd);
+}
+
+/* the channel is the tunnel from now on */
+void egress_attach(struct channel *channel)
+{
+	egress_reset();
+	channel->on_sent = egress_pull;
+	if (channel->fd >= 0)
+		egress_socket(channel);
+}
+
+/* drop everything that waits for a tunnel that is gone */
+void egress_reset(void)
+{
+	struct lane *lane;
+
+	while (active.next != &active) {
+		lane = lane_of(active.next);
+		pchain_clear(lane->queue);
+		lane_idle(lane);
+	}
+	queued = 0;
+	flush_armed = 0;
+	if (control)
+		pbuffer_clear(control);
+}
+
+void egress_options(int id, struct conf_options *opts)
+{
+	struct lane *lane = lane_get(id);
+
+	if (opts->weight > 0)
+		lane->weight = opts->weight;
+	if (opts->nodelay)
+		lane->nodelay = 1;
+}
+
+/* Send n frames of the tag. When nothing else is waiting they go to the
+ * kernel as they are; what it does not take moves to the lane of the tag,
+ * except the rest of a frame it took part of, which goes first. The frames
+ * are taken from the chain. */
+int egress_data(struct channel *out, int id, pchain *frames, int n)
+{
+	struct lane *lane = lane_get(id);
+	struct iovec iov[SEND_IOV];
+	ssize_t sent;
+	size_t size;
+
+	if (!out->on_send)
+		return -1;
+
+	stats.egress_frames += n;
+	if (settings.coalesce && !lane->nodelay) {
+		lane_add(lane, frames);
+		egress_hold(out);
+		return 0;
+	}
+
+	if (!queued && !(control && control->length) &&
+	    !out->send_chain->length) {
+		n = pchain_data_iov(frames, iov, SEND_IOV);
+		if ((sent = channel_writev(out, iov, n)) < 0)
+			return -1;
+		while (sent && (size = frame_size(frames)) <= sent) {
+			pchain_shift(frames, size);
+			sent -= size;
+		}
+		if (sent) {
+			pchain_shift(frames, sent);
+			pchain_move(out->send_chain, frames, size - sent);
+		}
+	}
+
+	lane_add(lane, frames);
+	stats.flush_now++;
+	egress_flush(out);
+	return 0;
+}
+
+/* send a control frame ahead of all data that is waiting */
+int egress_control(struct channel *out, void *frame, size_t len)
+{
+	if (!out->on_send)
+		return -1;
+	if (!control)
+		control = pbuffer_init();
+	pbuffer_add(control, frame, len);
+	stats.egress_frames++;
+	stats.flush_now++;
+	egress_flush(out);
+	return 0;
+}
+
+/* what the tag has waiting for the tunnel */
+size_t egress_queued(int id)
+{
+	if (id < 0 || id >= nlanes || !lanes[id])
+		return 0;
+	return lanes[id]->queue->length;
+}
+
+/* milliseconds until the held frames must go, or -1 */
+int egress_timeout(void)
+{
+	struct timespec now;
+	long ms;
+
+	if (!flush_armed)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (flush_at.tv_sec - now.tv_sec) * 1000 +
+		(flush_at.tv_nsec - now.tv_nsec + 999999) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+/* send the held frames once their deadline has passed */
+void egress_check(void)
+{
+	if (!flush_armed || egress_timeout() > 0)
+		return;
+	flush_armed = 0;
+	if (!tunnel->channel || !tunnel->channel->on_send)
+		return;
+	stats.flush_deadline++;
+	egress_flush(tunnel->channel);
+}
@@ -0,0 +1,39 @@
+#ifndef EGRESS_H
+#define EGRESS_H
+
+#include <sys/uio.h>
+#include "channels.h"
+
+/* Frames for the tunnel wait in a queue (lane) per tag, and are taken from
+ * the lanes by deficit round robin: on its turn a lane may send
+ * EGRESS_QUANTUM bytes times its weight, and what it could not use is kept
+ * for its next turn. Control frames (keepalives and stream windows) have a
+ * lane of their own that always goes first. Only EGRESS_BATCH bytes are
+ * moved to the send_chain of the tunnel at a time, and the kernel is told
+ * to keep little more than EGRESS_LOWAT unsent, so the order on the wire
+ * is decided here and not by whoever got to the socket first.
+ *
+ * With coalescing on (settings.coalesce), frames that find the tunnel idle
+ * are held until settings.coalesce bytes are waiting or settings.flush_delay
+ * microseconds have passed, so small frames share a write and a segment.
+ * Tags with the nodelay option, and control frames, flush at once. Writes
+ * with more to follow are sent with MSG_MORE. */
+
+/* payloads are cut into frames of at most this size */
+#define EGRESS_FRAME (32 * 1024)
+/* bytes per turn for weight 1; at least one full frame */
+#define EGRESS_QUANTUM (2 * EGRESS_FRAME)
+#define EGRESS_BATCH (64 * 1024)
+#define EGRESS_LOWAT (128 * 1024)
+
+void egress_socket(struct channel *);
+void egress_attach(struct channel *);
+void egress_reset(void);
+void egress_options(int , struct conf_options *);
+int egress_data(struct channel *, int , pchain *, int );
+int egress_control(struct channel *, void *, size_t );
+size_t egress_queued(int );
+int egress_timeout(void);
+void egress_check(void);
+
+#endif /* EGRESS_H */
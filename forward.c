@@ -5,6 +5,11 @@
 #include "tlv.h"
 #include "conf.h"
 #include "logging.h"
+#include "tags.h"
+#include "sessions.h"
+#include "egress.h"
+#include "compress.h"
+#include "alive.h"
 
 extern struct conf_tunnel *tunnel;
 
@@ -13,57 +18,328 @@ extern struct conf_tunnel *tunnel;
 
 struct channel *find_by_tag(char *tag)
 {
-	extern struct channel *deque;
-	struct channel *channel;
-	for_each_channel(deque, channel) {
-		if (!strcmp(channel->tag, tag))
-			return channel;
+	struct channel *channel = tag_channel(tag_lookup(tag));
+
+	if (!channel)
+		DB("Could not find channel with tag %s", tag);
+	return channel;
+}
+
+/* the output with the longest queue in the current parse, and the one
+ * that could not take any more */
+static struct channel *busiest, *blocked;
+/* the buffer the frames of the current parse are in */
+static pbuffer *source;
+
+static int deliver(struct forward_header *fh)
+{
+	struct channel *out;
+	pbuffer *payload = fh->payload;
+	pbuffer *owner = source;
+
+	if (fh->command == CT_FEATURES) {
+		compress_peer(fh->arg);
+		alive_peer(fh->arg);
+		return 0;
 	}
-	DB("Could not find channel with tag %s", tag);
-	return NULL;
+	if (fh->command == CT_KEEPALIVE) {
+		alive_reply(fh);
+		return 0;
+	}
+	if (fh->command == CT_ALIVE) {
+		alive_echo(fh);
+		return 0;
+	}
+
+	if (fh->stream) {
+		if (fh->command == CT_CLOSE) {
+			stream_remote_close(fh->stream);
+			return 0;
+		}
+		/* a stream is set up by its first window frame, which
+		 * carries the tag; frames of streams that are gone are
+		 * dropped */
+		if (!(out = session_find(fh->stream))) {
+			if (fh->command != CT_WINDOW || !fh->tag[0] ||
+			    !(out = stream_connect(fh)))
+				return 0;
+		}
+		if (fh->command == CT_WINDOW)
+			stream_window(fh->stream, fh->arg);
+		if (!fh->payload)
+			return 0;
+	} else {
+		if (!fh->payload)
+			return 0;
+		if (!fh->tag[0]) {
+			DBERR("The packet did not contain a tag; dropping");
+			return 0;
+		}
+		if (!(out = find_by_tag(fh->tag)))
+			return 0;
+	}
+	alive_heard();
+
+	/* Leave the frame in the tunnel until the output has drained. The
+	 * window keeps a stream below this, unless the far side ignores it. */
+	if (channel_queued(out) > settings.high_water +
+	    (out->stream ? out->rx_window : 0)) {
+		blocked = out;
+		return 1;
+	}
+
+	if (fh->zlength) {
+		if (!(payload = expand_payload(fh->zlength, payload))) {
+			DBERR("Could not inflate a payload for %s; dropping",
+			      out->tag);
+			return 0;
+		}
+		owner = payload;
+	}
+
+	if (channel_queue(out, owner, payload->data, payload->length))
+		return 0;
+	if (out->stream)
+		stream_delivered(out, payload->length);
+	if (!busiest || channel_queued(out) > channel_queued(busiest))
+		busiest = out;
+	return 0;
+}
+
+/* Parse the frames in one piece of the recv_buffer. Returns the number of
+ * bytes that can be consumed, or -1 when they are malformed. */
+static ssize_t parse_piece(void *data, size_t len, size_t *need)
+{
+	pbuffer piece = {
+		.length = len, .allocated = len, .start = data, .data = data,
+	};
+	ssize_t done;
+
+	if ((done = tlv_parse_frames(&piece, need, deliver)) > 0) {
+		hexdump(3, data, done);
+		decode_tlv_buffer(&piece, done);
+	}
+	return done;
 }
 
+/* Hand the complete frames in the recv_buffer to their outputs, and
+ * consume them once the outputs have taken them. An incomplete frame at the
+ * end is kept; when its size is known, nothing is parsed until it is
+ * all there. The recv_buffer is a ring: the frames are parsed where they
+ * are, except the one that goes on from the end of the ring to its start,
+ * which is parsed from a copy. An output that cannot take a payload at
+ * once keeps a reference to it where it is (see channel_queue()). */
 static struct channel *parse_tags(struct channel *channel)
 {
-	struct channel *out = NULL;
-	struct forward_header fh;
+	static pbuffer *frame;
 	pbuffer *b = channel->recv_buffer;
-	decode_tlv_buffer(b, b->length);
-	hexdump(3, (unsigned char *)b->data, b->length);
-	tlv_parse_tags(b, &fh);
-
-	if (fh.tag) {
-		out = find_by_tag(fh.tag);
-		if (fh.payload->length) {
-			pbuffer_copy(out->send_buffer, fh.payload,
-				     fh.payload->length);
+	unsigned char head[TORV_MAX];
+	struct iovec iov[2];
+	size_t size, need;
+	ssize_t done;
+	int n;
+
+	if (b->length < channel->rx_frame)
+		return NULL;
+
+	busiest = blocked = NULL;
+	while ((n = pbuffer_data_iov(b, iov))) {
+		source = b;
+		done = parse_piece(iov[0].iov_base, iov[0].iov_len,
+				   &channel->rx_frame);
+		if (done < 0)
+			goto malformed;
+		pbuffer_shift(b, done);
+		if (blocked || n == 1)
+			break;
+		if (done == iov[0].iov_len)
+			continue;
+
+		size = b->length < TORV_MAX ? b->length : TORV_MAX;
+		pbuffer_peek(b, head, size);
+		if (!(size = tlv_frame_size(head, size))) {
+			if (b->length >= TORV_MAX)
+				goto malformed;
+			break;
 		}
-	} else {
-		DBERR("The packet did not contain a tag; dropping");
+		if (size > FRAME_MAX + TORV_MAX)
+			goto malformed;
+		if (size > b->length) {
+			channel->rx_frame = size;
+			break;
+		}
+
+		DB("Frame of %zu bytes wraps around the ring", size);
+		if (!frame)
+			frame = pbuffer_init();
+		pbuffer_clear(frame);
+		pbuffer_assure(frame, size);
+		pbuffer_peek(b, frame->data, size);
+		source = frame;
+		if ((done = parse_piece(frame->data, size, &need)) < 0)
+			goto malformed;
+		if (!done)
+			break;
+		pbuffer_shift(b, size);
+		channel->rx_frame = 0;
 	}
-	return out;
+	return blocked ? blocked : busiest;
+
+malformed:
+	DBERR("Malformed data on the tunnel; closing");
+	channel->flags |= CHAN_CLOSE;
+	pbuffer_clear(b);
+	return NULL;
 }
 
-/* generate tags, and return the tunnel */
-static struct channel *generate_tags(struct channel *channel)
+/* show the frame as it goes out, at the highest debug level only */
+static void debug_frame(pchain *frames)
+{
+	pbuffer *frame;
+
+	if (loglevel < 3)
+		return;
+	frame = pbuffer_init();
+	pbuffer_assure(frame, frames->length);
+	frame->length = pchain_peek(frames, frame->data, frames->length);
+	hexdump(3, frame->data, frame->length);
+	decode_tlv_buffer(frame, frame->length);
+	pbuffer_free(frame);
+}
+
+/* The encoded start of the frames of the channel from src. It is made
+ * once, and again only when the source changes, as it does for UDP. The
+ * far side learned the tag, protocol and source of a stream when it was
+ * set up (see stream_open()), so the frames of a stream carry only its
+ * id. */
+static pbuffer *channel_prefix(struct channel *channel, struct psockaddr *src)
 {
 	struct forward_header fh;
+
+	if (channel->prefix->length && (channel->stream ||
+	    psockaddr_equal(&channel->prefix_src, src)))
+		return channel->prefix;
+
+	memset(&fh, 0, sizeof(fh));
+	fh.stream = channel->stream;
+	if (!fh.stream) {
+		strncpy(fh.tag, channel->tag, MAX_TAG);
+		fh.protocol = channel->protocol;
+		fh.src = *src;
+	}
+	pbuffer_clear(channel->prefix);
+	tlv_generate_prefix(&fh, channel->prefix);
+	channel->prefix_src = *src;
+	return channel->prefix;
+}
+
+/* Build the header of frame n of the channel, with the payload at
+ * start[n]. The payload is deflated to zbuf if that pays. */
+static void generate_frame(struct channel *channel, pbuffer *prefix,
+			   int n, size_t *start, size_t *length, size_t *zstart,
+			   pbuffer *headers, pbuffer *zbuf)
+{
+	pbuffer *in = channel->recv_buffer;
+	ssize_t zlen;
+
+	zstart[n] = zbuf->length;
+	zlen = compress_payload(channel, in->data + start[n], length[n], zbuf);
+	if (zlen < 0)
+		tlv_generate_start(prefix, 0, length[n], headers);
+	else
+		tlv_generate_start(prefix, length[n], zlen, headers);
+}
+
+/* Generate tags, and return the tunnel. Only the headers are built here;
+ * the payload is sent straight from the recv_buffer of the channel (or
+ * deflated, from zbuf), in frames of at most EGRESS_FRAME so no tag holds
+ * the tunnel for long. What the tunnel cannot take at once waits in a
+ * chain with references to those buffers, so nothing is copied. The
+ * recv_buffer is emptied every time, so its data is always in one piece. */
+static struct channel *generate_tags(struct channel *channel)
+{
+	static pbuffer *headers, *zbuf;
+	static pchain *frames;
+	size_t offset[UDP_BATCH_MAX + 1];
+	size_t start[UDP_BATCH_MAX], length[UDP_BATCH_MAX];
+	size_t zstart[UDP_BATCH_MAX + 1];
 	struct channel *out = tunnel->channel;
+	pbuffer *in = channel->recv_buffer;
+	pbuffer *prefix;
+	struct dgram *d;
+	size_t chunk, done;
+	int i, n = 0;
 
 	DB("Generating tags (%s)", channel->tag);
 
-	strncpy(fh.tag, channel->tag, MAX_TAG);
-	fh.protocol = channel->protocol;
-	fh.src = channel->src;
-	fh.payload = channel->recv_buffer;
-	tlv_generate_tags(&fh, out->send_buffer);
-	hexdump(3, out->send_buffer->data, out->send_buffer->length);
-	decode_tlv_buffer(out->send_buffer, out->send_buffer->length);
-	pbuffer_clear(channel->recv_buffer);
+	if (!headers) {
+		headers = pbuffer_init();
+		zbuf = pbuffer_init();
+		frames = pchain_init();
+	}
+	pbuffer_clear(headers);
+	pbuffer_clear(zbuf);
+
+	/* no tunnel to send it over */
+	if (!out || !out->on_send) {
+		DB("No tunnel; dropping %zu bytes", in->length);
+		channel->ndgrams = 0;
+		pbuffer_clear(in);
+		return NULL;
+	}
+
+	if (channel->ndgrams) {
+		/* one frame per datagram, each with its own source */
+		for (i = 0; i < channel->ndgrams; i++) {
+			d = &channel->dgrams[i];
+			prefix = channel_prefix(channel, &d->src);
+			offset[n] = headers->length;
+			start[n] = d->offset;
+			length[n] = d->length;
+			generate_frame(channel, prefix, n, start, length, zstart,
+				       headers, zbuf);
+			n++;
+		}
+		channel->ndgrams = 0;
+	} else {
+		chunk = EGRESS_FRAME;
+		if (in->length > chunk * UDP_BATCH_MAX)
+			chunk = (in->length + UDP_BATCH_MAX - 1) / UDP_BATCH_MAX;
+		prefix = channel_prefix(channel, &channel->src);
+		for (done = 0; done < in->length; done += length[n++]) {
+			offset[n] = headers->length;
+			start[n] = done;
+			length[n] = in->length - done < chunk ?
+				in->length - done : chunk;
+			generate_frame(channel, prefix, n, start, length, zstart,
+				       headers, zbuf);
+		}
+	}
+	offset[n] = headers->length;
+	zstart[n] = zbuf->length;
+
+	/* the headers may have moved while they grew */
+	for (i = 0; i < n; i++) {
+		pchain_add(frames, headers, headers->data + offset[i],
+			   offset[i + 1] - offset[i]);
+		if (zstart[i + 1] > zstart[i])
+			pchain_add(frames, zbuf, zbuf->data + zstart[i],
+				   zstart[i + 1] - zstart[i]);
+		else
+			pchain_add(frames, in, in->data + start[i], length[i]);
+	}
+
+	debug_frame(frames);
+	egress_data(out, channel->tagid, frames, n);
+	pchain_clear(frames);
+	if (channel->stream)
+		stream_forwarded(channel, in->length);
+	pbuffer_clear(in);
 	return out;
 }
 
-void forward_message(struct channel *in)
+/* forward the message, and return the channel it was queued on */
+struct channel *forward_message(struct channel *in)
 {
 	struct channel *out;
 
@@ -76,4 +352,5 @@ void forward_message(struct channel *in)
 	if (out) {
 		queue_send(out);
 	}
+	return out;
 }
@@ -10,9 +10,16 @@ struct forward_header {
 	int protocol;
 	struct psockaddr src;
 	struct psockaddr dst;
+	unsigned int stream;
+	unsigned int command;
+	unsigned int arg;
+	/* the time of a keepalive, as its sender's clock had it (us) */
+	unsigned int stamp;
+	/* the size of the payload once inflated, if it is deflated */
+	unsigned int zlength;
 	pbuffer *payload;
 };
 
-void forward_message(struct channel *);
+struct channel *forward_message(struct channel *);
 
 #endif /* FORWARD_H */
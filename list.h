@@ -6,7 +6,9 @@ struct list {
 	struct list *next;
 };
 
+#ifndef offsetof
 #define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
+#endif
 
 #define containerof(ptr, type, member) ({				\
 			const typeof(((type *)0)->member) *__mptr = (ptr); \
@@ -43,6 +45,18 @@ static inline void list_init(struct list *node)
 	list_link(node, node);
 }
 
+/* move all nodes from one list head to another (empty) head */
+static inline void list_splice(struct list *from, struct list *to)
+{
+	if (from->next == from) {
+		list_init(to);
+		return;
+	}
+	list_link(to, from->next);
+	list_link(from->prev, to);
+	list_init(from);
+}
+
 static inline void list_free(struct list *node)
 {
 	list_unlink(node);
@@ -131,94 +131,107 @@ void hexdump(int level, const unsigned char *payload, size_t len)
 	hexdump_indent(level, payload, len, 0);
 }
 
-static void get_tlvs(struct pbuffer *, size_t ,
-		     void (*)(struct tlv *));
+/* dump data in pieces, such as a ring buffer */
+void hexdump_iov(int level, struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		hexdump_indent(level, iov[i].iov_base, iov[i].iov_len, 0);
+}
+
+static void get_tlvs(unsigned char *, size_t ,
+		     void (*)(struct tlv_view *));
 
-static void debug_tlv(int indent, struct tlv *tlv, const char **names)
+static void debug_tlv(int indent, struct tlv_view *tv, const char **names,
+		      unsigned int num)
 {
-	debug_nt(3, indent, "%s (%d) [%d]", names[tlv->type], tlv->type,
-		 tlv->length);
+	debug_nt(3, indent, "%s (%u) [%u]",
+		 tv->type < num && names[tv->type] ? names[tv->type] : "?",
+		 tv->type, tv->length);
 }
 
-static void decode_ptypes(struct tlv *tlv)
+static void decode_ptypes(struct tlv_view *tv)
 {
-	struct psockaddr psa;
+	char addr[INET6_ADDRSTRLEN];
 
-	debug_tlv(1, tlv, PT_NAMES);
+	debug_tlv(1, tv, PT_NAMES, PT_NUM);
 
-	switch (tlv->type) {
+	switch (tv->type) {
 	case PT_FAMILY:
-		debug_nt(3, 2, "%u", extract_byte(tlv->value));
+		if (tv->length == 1)
+			debug_nt(3, 2, "%u", tv->value[0]);
 		break;
 	case PT_IPADDR:
-		debug_nt(3, 2, "%s", extract_ip(&psa, tlv->value,
-						 tlv->length));
+		if ((tv->length == 4 || tv->length == 16) &&
+		    inet_ntop(tv->length == 4 ? AF_INET : AF_INET6, tv->value,
+			      addr, sizeof(addr)))
+			debug_nt(3, 2, "%s", addr);
 		break;
 	case PT_PORT:
-		debug_nt(3, 2, "%u", extract_su(tlv->value, tlv->length));
+		if (tv->length == 2)
+			debug_nt(3, 2, "%u", tv->value[0] << 8 | tv->value[1]);
 		break;
 	default:
-		hexdump_indent(3, tlv->value->data, tlv->length, 2);
+		hexdump_indent(3, tv->value, tv->length, 2);
 		break;
 	}
 }
 
-static void decode_ctypes(struct tlv *tlv)
+static void decode_ctypes(struct tlv_view *tv)
 {
-	debug_tlv(1, tlv, CT_NAMES);
+	debug_tlv(1, tv, CT_NAMES, CT_NUM);
 
-	switch (tlv->type) {
+	switch (tv->type) {
 	case CT_KEEPALIVE:
 	case CT_ALIVE:
 		break;
 	default:
-		hexdump_indent(3, tlv->value->data, tlv->length, 2);
+		hexdump_indent(3, tv->value, tv->length, 2);
 		break;
 	}
 }
 
-static void decode_types(struct tlv *tlv)
+static void decode_types(struct tlv_view *tv)
 {
-	debug_tlv(0, tlv, T_NAMES);
-	switch (tlv->type) {
+	debug_tlv(0, tv, T_NAMES, T_NUM);
+	switch (tv->type) {
 	case T_SRC:
 	case T_DST:
-		get_tlvs(tlv->value, tlv->length, &decode_ptypes);
+		get_tlvs(tv->value, tv->length, &decode_ptypes);
 		break;
 	case T_COMMAND:
-		get_tlvs(tlv->value, tlv->length, &decode_ctypes);
+		get_tlvs(tv->value, tv->length, &decode_ctypes);
 	default:
-		hexdump_indent(3, tlv->value->data, tlv->length, 1);
+		hexdump_indent(3, tv->value, tv->length, 1);
 	}
 }
 
-static void get_tlvs(struct pbuffer *buffer, size_t len,
-		     void (*callback)(struct tlv *))
+/* walk the tlvs in place; a malformed one ends the walk */
+static void get_tlvs(unsigned char *data, size_t len,
+		     void (*callback)(struct tlv_view *))
 {
-	struct tlv *tlv = tlv_init();
-	size_t bytes;
-	size_t offset = pbuffer_offset(buffer);
-	size_t length = buffer->length;
-
-	while (len > 0) {
-		bytes = extract_torv(buffer, &tlv->type);
-		len -= bytes;
-		bytes = extract_torv(buffer, &tlv->length);
-		len -= bytes;
-		pbuffer_set(tlv->value, buffer->data, tlv->length);
-
-		if (callback)
-			callback(tlv);
-
-		pbuffer_safe_shift(buffer, tlv->length);
-		len -= tlv->length;
-	}
-	buffer->data = buffer->start + offset;
-	buffer->length = length;
-	tlv_free(tlv);
+	struct tlv_cursor c;
+	struct tlv_view tv;
+
+	tlv_cursor_init(&c, data, len);
+	while (tlv_next(&c, &tv) > 0)
+		callback(&tv);
+	if (c.avail)
+		debug_nt(3, 0, "MALFORMED [%zu]", c.avail);
 }
 
+/* decode the frames in the buffer; each is a length, then its tlvs */
 void decode_tlv_buffer(pbuffer *buffer, size_t len)
 {
-	get_tlvs(buffer, len, &decode_types);
+	struct tlv_cursor c, frame;
+
+	if (loglevel < 3)
+		return;
+
+	tlv_cursor_init(&c, buffer->data, len);
+	while (tlv_next_frame(&c, &frame) > 0) {
+		debug_nt(3, 0, "FRAME [%zu]", frame.avail);
+		get_tlvs(frame.pos, frame.avail, &decode_types);
+	}
 }
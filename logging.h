@@ -14,6 +14,7 @@ void debug_nt(int , int , const char *, ...)
 	__attribute__((format(printf, 3, 4)));
 
 void hexdump(int , const unsigned char *, size_t );
+void hexdump_iov(int , struct iovec *, int );
 
 void decode_tlv_buffer(pbuffer *, size_t );
 #endif /* LOGGING_H */
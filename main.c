@@ -7,11 +7,9 @@ extern int loglevel;
 
 int main(int argc, char **argv)
 {
-	extern struct timer *timers;
 	loglevel = 0;
 
 	channels_init();
-	timers = timer_init();
 
 	if ((get_config_files(argc, argv)) < 0) {
 		return 1;
@@ -28,27 +28,149 @@
 
 #define DB(fmt, args...) debug(4, "[pbuf]: " fmt, ##args)
 
-static size_t pbuffer_grow(pbuffer *buffer, size_t size)
+/* Buffer storage comes in size classes, the powers of two from
+ * PBUFFER_MIN up. Freed blocks wait on a list per class for the next
+ * buffer of that size, up to POOL_KEEP bytes in all; blocks larger than
+ * the largest class go back to malloc. Storage is never cleared. The
+ * pooled blocks count toward the cap: they are given back to malloc
+ * before a reservation is refused. */
+#define POOL_CLASSES 18
+#define POOL_KEEP (16 * 1024 * 1024)
+
+struct pool_block {
+	struct pool_block *next;
+};
+
+static struct pool_block *pool[POOL_CLASSES];
+struct pbuffer_pool pbuffer_pool;
+
+static int pool_class(size_t size)
 {
-	if (size < pbuffer_unused(buffer)) {
-		return(buffer->allocated);
+	return __builtin_ctzl(size) - __builtin_ctzl(PBUFFER_MIN);
+}
+
+static void *pool_get(size_t size)
+{
+	int class = pool_class(size);
+	struct pool_block *block;
+
+	if (class < POOL_CLASSES && (block = pool[class])) {
+		pool[class] = block->next;
+		pbuffer_pool.pooled -= size;
+		pbuffer_pool.reused++;
+	} else if (!(block = malloc(size))) {
+		return NULL;
 	}
-	size_t newsize = (buffer->allocated*2) | PBUFFER_MIN;
-	size_t offset = buffer->data - buffer->start;
+	pbuffer_pool.allocs++;
+	pbuffer_pool.live += size;
+	if (pbuffer_pool.live > pbuffer_pool.peak)
+		pbuffer_pool.peak = pbuffer_pool.live;
+	return block;
+}
 
-	buffer->start = realloc(buffer->start, newsize);
+static void pool_put(void *data, size_t size)
+{
+	int class = pool_class(size);
+	struct pool_block *block = data;
+
+	pbuffer_pool.live -= size;
+	if (class >= POOL_CLASSES || pbuffer_pool.pooled + size > POOL_KEEP ||
+	    (pbuffer_pool.cap && pbuffer_pool.live + pbuffer_pool.pooled +
+	     size > pbuffer_pool.cap)) {
+		free(data);
+		return;
+	}
+	block->next = pool[class];
+	pool[class] = block;
+	pbuffer_pool.pooled += size;
+}
 
-	if (buffer->start == NULL) {
-		printf("error reallocating memory.\n");
-		return(0);
+/* Give pooled blocks back to malloc, the largest first, until size more
+ * bytes fit under the cap */
+static void pool_trim(size_t size)
+{
+	struct pool_block *block;
+	int class;
+
+	for (class = POOL_CLASSES - 1; class >= 0; class--) {
+		while ((block = pool[class]) && pbuffer_pool.live +
+		       pbuffer_pool.pooled + size > pbuffer_pool.cap) {
+			pool[class] = block->next;
+			pbuffer_pool.pooled -= (size_t)PBUFFER_MIN << class;
+			free(block);
+		}
 	}
+}
 
-	buffer->data = buffer->start + offset;
+/* the size class that fits size bytes */
+static size_t pool_size(size_t size)
+{
+	size_t class = PBUFFER_MIN;
 
-	buffer->allocated = newsize;
+	while (class < size)
+		class *= 2;
+	return class;
+}
+
+static void pblock_put(struct pblock *block)
+{
+	if (--block->refs)
+		return;
+	pool_put(block->start, block->allocated);
+	free(block);
+}
+
+/* Make the storage of the buffer its own again before it is written: the
+ * data left in it moves to new storage if chains still refer to it. */
+static void pbuffer_own(pbuffer *buffer)
+{
+	struct pblock *block = buffer->block;
+	void *start;
 
-	/* Clear fresh memory */
-	memset(pbuffer_end(buffer), 0, pbuffer_unused(buffer));
+	buffer->block = NULL;
+	if (block->refs == 1) {
+		free(block);
+		return;
+	}
+	start = pool_get(buffer->allocated);
+	pbuffer_peek(buffer, start, buffer->length);
+	buffer->start = buffer->data = start;
+	pblock_put(block);
+}
+
+/* Grow the buffer until there are at least size unused bytes. The data
+ * moves to the start of a block of the next size class that fits, in one
+ * piece, also for a ring. With capped set, the buffer does not grow past
+ * the cap of the pool. */
+static size_t pbuffer_grow(pbuffer *buffer, size_t size, int capped)
+{
+	size_t newsize = buffer->allocated * 2;
+	void *start;
+
+	if (size <= pbuffer_unused(buffer)) {
+		return(buffer->allocated);
+	}
+	while (newsize < buffer->length + size)
+		newsize *= 2;
+
+	if (capped && pbuffer_pool.cap) {
+		if (pbuffer_pool.live + pbuffer_pool.pooled -
+		    buffer->allocated + newsize > pbuffer_pool.cap)
+			pool_trim(newsize - buffer->allocated);
+		if (pbuffer_pool.live - buffer->allocated + newsize >
+		    pbuffer_pool.cap) {
+			pbuffer_pool.refused++;
+			return(0);
+		}
+	}
+	if ((start = pool_get(newsize)) == NULL) {
+		printf("error reallocating memory.\n");
+		return(0);
+	}
+	pbuffer_peek(buffer, start, buffer->length);
+	pool_put(buffer->start, buffer->allocated);
+	buffer->start = buffer->data = start;
+	buffer->allocated = newsize;
 	return(newsize);
 }
 
@@ -58,14 +180,76 @@ pbuffer *pbuffer_init(void)
 	newbuffer = malloc(sizeof(pbuffer));
 	newbuffer->length = 0;
 
-	newbuffer->data = malloc(PBUFFER_MIN);
+	newbuffer->data = pool_get(PBUFFER_MIN);
 	newbuffer->allocated = PBUFFER_MIN;
 	newbuffer->start = newbuffer->data;
-
-	memset(newbuffer->data, 0, newbuffer->allocated);
+	newbuffer->ring = 0;
+	newbuffer->block = NULL;
 	return(newbuffer);
 }
 
+/* every block is a power of two, so any buffer can be a ring */
+void pbuffer_ring(pbuffer *buffer)
+{
+	buffer->data = buffer->start;
+	buffer->length = 0;
+	buffer->ring = 1;
+}
+
+int pbuffer_data_iov(pbuffer *buffer, struct iovec *iov)
+{
+	size_t first = buffer->allocated - pbuffer_offset(buffer);
+
+	if (!buffer->length)
+		return 0;
+	iov[0].iov_base = buffer->data;
+	if (!buffer->ring || buffer->length <= first) {
+		iov[0].iov_len = buffer->length;
+		return 1;
+	}
+	iov[0].iov_len = first;
+	iov[1].iov_base = buffer->start;
+	iov[1].iov_len = buffer->length - first;
+	return 2;
+}
+
+int pbuffer_space_iov(pbuffer *buffer, struct iovec *iov)
+{
+	size_t tail = pbuffer_offset(buffer) + buffer->length;
+
+	if (!pbuffer_unused(buffer))
+		return 0;
+	if (!buffer->ring || tail >= buffer->allocated) {
+		if (buffer->ring)
+			tail -= buffer->allocated;
+		iov[0].iov_base = buffer->start + tail;
+		iov[0].iov_len = pbuffer_unused(buffer);
+		return 1;
+	}
+	iov[0].iov_base = buffer->start + tail;
+	iov[0].iov_len = buffer->allocated - tail;
+	if (!pbuffer_offset(buffer))
+		return 1;
+	iov[1].iov_base = buffer->start;
+	iov[1].iov_len = pbuffer_offset(buffer);
+	return 2;
+}
+
+void pbuffer_peek(pbuffer *buffer, void *dest, size_t len)
+{
+	struct iovec iov[2];
+	int n = pbuffer_data_iov(buffer, iov);
+
+	if (!n || len > buffer->length)
+		return;
+	if (len <= iov[0].iov_len) {
+		memcpy(dest, iov[0].iov_base, len);
+		return;
+	}
+	memcpy(dest, iov[0].iov_base, iov[0].iov_len);
+	memcpy(dest + iov[0].iov_len, iov[1].iov_base, len - iov[0].iov_len);
+}
+
 void pbuffer_set(pbuffer *buffer, void *data, size_t size)
 {
 	pbuffer_assure(buffer, size);
@@ -119,8 +303,21 @@ int pbuffer_strcpy(pbuffer *buffer, char *data)
 
 void pbuffer_add(pbuffer *buffer, void *data, size_t size)
 {
-	pbuffer_assure(buffer, size + buffer->length);
-	memcpy(pbuffer_end(buffer), data, size);
+	struct iovec iov[2];
+
+	pbuffer_assure(buffer, size);
+	if (buffer->ring && size) {
+		pbuffer_space_iov(buffer, iov);
+		if (size <= iov[0].iov_len) {
+			memcpy(iov[0].iov_base, data, size);
+		} else {
+			memcpy(iov[0].iov_base, data, iov[0].iov_len);
+			memcpy(iov[1].iov_base, data + iov[0].iov_len,
+			       size - iov[0].iov_len);
+		}
+	} else {
+		memcpy(pbuffer_end(buffer), data, size);
+	}
 	buffer->length += size;
 }
 
@@ -148,6 +345,9 @@ int pbuffer_strcat(pbuffer *buffer, char *data)
 
 void pbuffer_consume(pbuffer *buffer)
 {
+	/* a ring never moves its data */
+	if (buffer->ring)
+		return;
 	/* only shift the remainder when there is enough space */
 	if (buffer->length < (buffer->data - buffer->start)) {
 		memmove(buffer->start, buffer->data, buffer->length);
@@ -167,11 +367,17 @@ void pbuffer_safe_shift(pbuffer *buffer, size_t size)
 		return;
 
 	/* can't shift past the end of the buffer */
-	if (size >= buffer->length)
+	if (size > buffer->length)
 		return;
 
-	buffer->data = (buffer->data + size);
 	buffer->length = (buffer->length - size);
+	if (!buffer->ring)
+		buffer->data = (buffer->data + size);
+	else if (!buffer->length)
+		buffer->data = buffer->start;
+	else
+		buffer->data = buffer->start + ((pbuffer_offset(buffer) + size) &
+						(buffer->allocated - 1));
 }
 
 void pbuffer_extract(pbuffer *buffer, void *dest, size_t len)
@@ -194,13 +400,22 @@ void pbuffer_safe_extract(pbuffer *buffer, void *dest, size_t len)
 
 int pbuffer_assure(pbuffer *buffer, size_t size)
 {
-	int ret = 0;
-
+	if (buffer->block)
+		pbuffer_own(buffer);
 	if (pbuffer_unused(buffer) < size) {
-		ret = pbuffer_grow(buffer, size);
+		if (!pbuffer_grow(buffer, size, 0))
+			return(-1);
 	}
-	if (ret < size) {
-		ret = pbuffer_grow(buffer, (size * 2) | PBUFFER_MIN);
+	return(0);
+}
+
+int pbuffer_reserve(pbuffer *buffer, size_t size)
+{
+	if (buffer->block)
+		pbuffer_own(buffer);
+	if (pbuffer_unused(buffer) < size) {
+		if (!pbuffer_grow(buffer, size, 1))
+			return(-1);
 	}
 	return(0);
 }
@@ -222,6 +437,187 @@ void pbuffer_stats(pbuffer *buffer)
 void pbuffer_free(pbuffer *buffer)
 {
 	if (buffer) {
+		if (buffer->block)
+			pblock_put(buffer->block);
+		else
+			pool_put(buffer->start, buffer->allocated);
 		free(buffer);
 	}
 }
+
+pchain *pchain_init(void)
+{
+	pchain *chain = malloc(sizeof(pchain));
+
+	chain->head = chain->last = NULL;
+	chain->length = 0;
+	chain->copy = NULL;
+	return chain;
+}
+
+static void pchain_append(pchain *chain, struct pblock *block, void *data,
+			  size_t len)
+{
+	struct pslice *slice = malloc(sizeof(struct pslice));
+
+	slice->next = NULL;
+	slice->block = block;
+	slice->data = data;
+	slice->length = len;
+	if (chain->last)
+		chain->last->next = slice;
+	else
+		chain->head = slice;
+	chain->last = slice;
+	chain->length += len;
+}
+
+void pchain_add(pchain *chain, pbuffer *buffer, void *data, size_t len)
+{
+	struct pslice *last = chain->last;
+
+	if (!len)
+		return;
+	if (!buffer->block) {
+		buffer->block = malloc(sizeof(struct pblock));
+		buffer->block->refs = 1;
+		buffer->block->start = buffer->start;
+		buffer->block->allocated = buffer->allocated;
+		buffer->block->used = buffer->allocated;
+	}
+	/* it goes on where the last slice ends */
+	if (last && last->block == buffer->block &&
+	    last->data + last->length == data) {
+		last->length += len;
+		chain->length += len;
+		return;
+	}
+	buffer->block->refs++;
+	pchain_append(chain, buffer->block, data, len);
+}
+
+
+void pchain_copy(pchain *chain, void *data, size_t len)
+{
+	struct pslice *last = chain->last;
+	struct pblock *block = chain->copy;
+	void *dest;
+
+	if (!len)
+		return;
+	if (!block || block->allocated - block->used < len) {
+		if (block)
+			pblock_put(block);
+		block = chain->copy = malloc(sizeof(struct pblock));
+		block->refs = 1;
+		block->allocated = pool_size(len < PCHAIN_BLOCK ?
+					     PCHAIN_BLOCK : len);
+		block->start = pool_get(block->allocated);
+		block->used = 0;
+	}
+	dest = block->start + block->used;
+	memcpy(dest, data, len);
+	block->used += len;
+	/* it goes on where the last slice ends */
+	if (last && last->block == block && last->data + last->length == dest) {
+		last->length += len;
+		chain->length += len;
+		return;
+	}
+	block->refs++;
+	pchain_append(chain, block, dest, len);
+}
+
+void pchain_move(pchain *dst, pchain *src, size_t len)
+{
+	struct pslice *slice;
+
+	if (len > src->length)
+		len = src->length;
+	while (len) {
+		slice = src->head;
+		if (slice->length > len) {
+			/* the rest stays; both halves hold a reference */
+			slice->block->refs++;
+			pchain_append(dst, slice->block, slice->data, len);
+			slice->data += len;
+			slice->length -= len;
+			src->length -= len;
+			return;
+		}
+		if (!(src->head = slice->next))
+			src->last = NULL;
+		src->length -= slice->length;
+		len -= slice->length;
+		slice->next = NULL;
+		if (dst->last)
+			dst->last->next = slice;
+		else
+			dst->head = slice;
+		dst->last = slice;
+		dst->length += slice->length;
+	}
+}
+
+void pchain_shift(pchain *chain, size_t len)
+{
+	struct pslice *slice;
+
+	if (len > chain->length)
+		len = chain->length;
+	chain->length -= len;
+	while (len) {
+		slice = chain->head;
+		if (slice->length > len) {
+			slice->data += len;
+			slice->length -= len;
+			return;
+		}
+		len -= slice->length;
+		if (!(chain->head = slice->next))
+			chain->last = NULL;
+		pblock_put(slice->block);
+		free(slice);
+	}
+}
+
+size_t pchain_peek(pchain *chain, void *dest, size_t len)
+{
+	struct pslice *slice;
+	size_t done = 0, n;
+
+	for (slice = chain->head; slice && done < len; slice = slice->next) {
+		n = slice->length < len - done ? slice->length : len - done;
+		memcpy(dest + done, slice->data, n);
+		done += n;
+	}
+	return done;
+}
+
+int pchain_data_iov(pchain *chain, struct iovec *iov, int max)
+{
+	struct pslice *slice;
+	int n = 0;
+
+	for (slice = chain->head; slice && n < max; slice = slice->next) {
+		iov[n].iov_base = slice->data;
+		iov[n].iov_len = slice->length;
+		n++;
+	}
+	return n;
+}
+
+void pchain_clear(pchain *chain)
+{
+	pchain_shift(chain, chain->length);
+}
+
+void pchain_free(pchain *chain)
+{
+	if (chain) {
+		pchain_clear(chain);
+		if (chain->copy)
+			pblock_put(chain->copy);
+		free(chain);
+	}
+}
@@ -21,8 +21,10 @@
 
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
-#define PBUFFER_MIN 120
+/* the smallest block; all blocks are this times a power of two */
+#define PBUFFER_MIN 128
 
 #define pbuffer_end(a) (a->data + a->length)
 
@@ -34,9 +36,18 @@
  *  |........|................|................|
  *  ^ start  ^ data           ^ end
  */
-#define pbuffer_unused(a) (a->start + a->allocated - pbuffer_end(a))
+#define pbuffer_unused(a) ((a)->ring ? (a)->allocated - (a)->length : \
+			   (size_t)(a->start + a->allocated - pbuffer_end(a)))
 #define pbuffer_offset(a) (a->data - a->start)
 
+/* A ring buffer is never compacted: its data runs from data to the end of
+ * the allocation and goes on at start, and shifting only moves data
+ * along. The allocation is a power of two. Use pbuffer_data_iov() and
+ * pbuffer_space_iov() to get at the data and the unused space, which can
+ * both be in two pieces; pbuffer_end() does not apply, and pbuffer_unused()
+ * is all the space, in however many pieces. An empty ring starts over at
+ * start. */
+
 typedef struct pbuffer pbuffer;
 
 struct pbuffer {
@@ -44,11 +55,79 @@ struct pbuffer {
 	size_t allocated;
 	void *start;
 	void *data;
+	int ring;
+	/* the storage, once chains hold references to it */
+	struct pblock *block;
+};
+
+/* A chain is a queue of slices of storage that is shared by reference,
+ * like mbufs: data moves from buffer to chain and from chain to chain
+ * without being copied. A buffer shares its storage with pchain_add();
+ * the next time it makes room for more data it moves to new storage, and
+ * the old storage goes back to the pool when the last slice in it has
+ * been sent. Only what is written with pbuffer_add(), or after
+ * pbuffer_assure() or pbuffer_reserve(), is safe for the slices. */
+struct pblock {
+	unsigned int refs;
+	void *start;
+	size_t allocated;
+	/* what pchain_copy() wrote, which never changes after; the
+	 * storage of a buffer counts as all used */
+	size_t used;
 };
 
+struct pslice {
+	struct pslice *next;
+	struct pblock *block;
+	void *data;
+	size_t length;
+};
+
+typedef struct pchain {
+	struct pslice *head;
+	struct pslice *last;
+	size_t length;
+	/* where pchain_copy() writes */
+	struct pblock *copy;
+} pchain;
+
+/* room for the small pieces that pchain_copy() collects */
+#define PCHAIN_BLOCK 4096
+/* Pieces smaller than this that stay queued are better copied than
+ * shared: one slice keeps the whole storage of the buffer, which must then
+ * move to new storage before the buffer takes more data. */
+#define PCHAIN_SHARE 16384
+
+/* The storage of all buffers, in bytes, and how it was allocated. The cap
+ * covers only what is reserved to receive into (pbuffer_reserve()): the
+ * writes that may not fail (pbuffer_assure(), pchain_copy(), moving shared
+ * storage, inflating a payload) count toward live, but may take it over
+ * the cap. They hold what was received, so stopping the reads at the cap
+ * bounds them too. */
+struct pbuffer_pool {
+	size_t live;		/* held by buffers */
+	size_t pooled;		/* freed, and kept for reuse */
+	size_t peak;		/* the most ever held by buffers */
+	size_t cap;		/* pbuffer_reserve() stays below this; 0 is none */
+	unsigned long allocs;
+	unsigned long reused;	/* allocations served from the pool */
+	unsigned long refused;	/* reservations over the cap */
+};
+
+extern struct pbuffer_pool pbuffer_pool;
+
 /* Allocate memory for the buffer. Return the pointer to the buffer. */
 pbuffer *pbuffer_init(void);
 
+/* Make an empty buffer a ring buffer. */
+void pbuffer_ring(pbuffer *);
+/* The data as at most two pieces; returns how many. */
+int pbuffer_data_iov(pbuffer *, struct iovec *);
+/* The unused space after the data as at most two pieces. */
+int pbuffer_space_iov(pbuffer *, struct iovec *);
+/* Copy the first bytes of the data, without consuming them. */
+void pbuffer_peek(pbuffer *, void *, size_t );
+
 /* Set the buffer to this value. */
 void pbuffer_set(pbuffer *, void *, size_t );
 int pbuffer_strcpy(pbuffer *, char *);
@@ -78,8 +157,10 @@ void pbuffer_safe_extract(pbuffer *, void *, size_t);
 /* Copy the contents of one buffer to another */
 int pbuffer_copy(pbuffer *, pbuffer *, size_t );
 
-/* Assure size of the buffer */
+/* Assure there are at least this many unused bytes after the data */
 int pbuffer_assure(pbuffer *, size_t );
+/* The same, but fails rather than grow the storage past the cap */
+int pbuffer_reserve(pbuffer *, size_t );
 
 static inline void pbuffer_start(pbuffer *b)
 {
@@ -92,6 +173,22 @@ static inline void pbuffer_clear(pbuffer *b)
 	b->length = 0;
 }
 
+pchain *pchain_init(void);
+/* Add len bytes at data, in the storage of the buffer, by reference. */
+void pchain_add(pchain *, pbuffer *, void *, size_t );
+/* Add a copy of the bytes; for pieces too small to share. */
+void pchain_copy(pchain *, void *, size_t );
+/* Move the first bytes of one chain to the end of another. */
+void pchain_move(pchain *, pchain *, size_t );
+/* Drop the first bytes of the chain. */
+void pchain_shift(pchain *, size_t );
+/* Copy the first bytes, without consuming them; returns how many. */
+size_t pchain_peek(pchain *, void *, size_t );
+/* The data as at most max pieces; returns how many. */
+int pchain_data_iov(pchain *, struct iovec *, int );
+void pchain_clear(pchain *);
+void pchain_free(pchain *);
+
 /* Print statistics for the buffer */
 void pbuffer_stats(pbuffer *);
 
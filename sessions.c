@@ -0,0 +1,352 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sessions.h"
+#include "tags.h"
+#include "tlv.h"
+#include "conf.h"
+#include "logging.h"
+#include "stats.h"
+#include "egress.h"
+
+extern struct conf_tunnel *tunnel;
+extern struct channel *deque;
+
+#define DB(fmt, args...) debug(3, "[sess]: " fmt, ##args)
+#define DBWARN(fmt, args...) debug(1, "[sess]: " fmt, ##args)
+
+/* the table is kept at most half full */
+#define SESSIONS_MIN 64
+
+struct session {
+	unsigned int stream;
+	struct channel *channel;
+};
+
+/* open addressing with linear probing; stream 0 is an empty slot */
+static struct session *sessions;
+static size_t sessions_size;
+static size_t nsessions;
+
+static unsigned int next_stream;
+
+static size_t session_slot(unsigned int stream)
+{
+	size_t mask = sessions_size - 1;
+	size_t i = (stream * 2654435761u) & mask;
+
+	while (sessions[i].stream && sessions[i].stream != stream)
+		i = (i + 1) & mask;
+	return i;
+}
+
+static void sessions_grow(void)
+{
+	struct session *old = sessions;
+	size_t i, oldsize = sessions_size;
+
+	sessions_size = oldsize ? oldsize * 2 : SESSIONS_MIN;
+	sessions = calloc(sessions_size, sizeof(struct session));
+	for (i = 0; i < oldsize; i++) {
+		if (old[i].stream)
+			sessions[session_slot(old[i].stream)] = old[i];
+	}
+	free(old);
+}
+
+static void session_add(unsigned int stream, struct channel *channel)
+{
+	size_t i;
+
+	if ((nsessions + 1) * 2 > sessions_size)
+		sessions_grow();
+	i = session_slot(stream);
+	if (!sessions[i].stream)
+		nsessions++;
+	sessions[i].stream = stream;
+	sessions[i].channel = channel;
+}
+
+struct channel *session_find(unsigned int stream)
+{
+	size_t i;
+
+	if (!sessions_size)
+		return NULL;
+	i = session_slot(stream);
+	return sessions[i].stream ? sessions[i].channel : NULL;
+}
+
+/* Remove the stream, and move the entries after it that are not in their
+ * own slot back, so no lookup ever stops early. */
+static void session_del(unsigned int stream)
+{
+	size_t mask = sessions_size - 1;
+	size_t i, j, home;
+
+	if (!sessions_size)
+		return;
+	i = session_slot(stream);
+	if (!sessions[i].stream)
+		return;
+	sessions[i].stream = 0;
+	nsessions--;
+
+	for (j = (i + 1) & mask; sessions[j].stream; j = (j + 1) & mask) {
+		home = (sessions[j].stream * 2654435761u) & mask;
+		/* can the entry at j move to the hole at i? */
+		if ((j > i && (home <= i || home > j)) ||
+		    (j < i && (home <= i && home > j))) {
+			sessions[i] = sessions[j];
+			sessions[j].stream = 0;
+			i = j;
+		}
+	}
+}
+
+/* The tunnel is gone, and the streams with it: the far side forgets them
+ * too. Close their channels, without telling a far side that is not
+ * there, so the clients see the end of the stream. */
+void sessions_reset(void)
+{
+	size_t i;
+
+	for (i = 0; i < sessions_size; i++) {
+		if (sessions[i].stream)
+			channel_kill(sessions[i].channel);
+	}
+	if (sessions_size)
+		memset(sessions, 0, sessions_size * sizeof(struct session));
+	nsessions = 0;
+	next_stream = 0;
+}
+
+/* Build a command for the stream. It goes to the far side ahead of any
+ * data, except for a close: that must not pass the last data of the
+ * stream, so it waits in the lane of the tag (tagid >= 0) like the data. */
+static void send_command(unsigned int stream, unsigned int command,
+			 unsigned int arg, int tagid)
+{
+	static pbuffer *frame;
+	static pchain *chain;
+	struct forward_header fh;
+
+	if (!tunnel->channel)
+		return;
+	if (!frame) {
+		frame = pbuffer_init();
+		chain = pchain_init();
+	}
+	pbuffer_clear(frame);
+
+	memset(&fh, 0, sizeof(fh));
+	fh.stream = stream;
+	fh.command = command;
+	fh.arg = arg;
+	tlv_generate_frame(&fh, 0, frame);
+
+	if (tagid < 0) {
+		egress_control(tunnel->channel, frame->data, frame->length);
+		return;
+	}
+	pchain_add(chain, frame, frame->data, frame->length);
+	egress_data(tunnel->channel, tagid, chain, 1);
+	pchain_clear(chain);
+}
+
+/* tell the far side the stream is gone */
+static void send_close(unsigned int stream, int tagid)
+{
+	send_command(stream, CT_CLOSE, 0, tagid);
+}
+
+/* Give credit for what has left through the output. The far side gets it
+ * in chunks of half the window, so it never runs dry while we keep up and
+ * small exchanges do not cost a window frame each. */
+static int stream_credit(struct channel *channel)
+{
+	size_t queued = channel_queued(channel);
+	size_t credit;
+
+	if (channel->rx_credit <= queued)
+		return 0;
+	credit = channel->rx_credit - queued;
+	if (credit < channel->rx_window / 2)
+		return 0;
+
+	DB("Stream %u gets %zu bytes of credit", channel->stream, credit);
+	channel->rx_credit -= credit;
+	send_command(channel->stream, CT_WINDOW, credit, -1);
+	return 0;
+}
+
+/* Set up the stream on the far side: the window frame that opens it binds
+ * the id to the tag, protocol and source of the client, and its data
+ * frames carry only the id from then on. */
+static void send_open(struct channel *channel)
+{
+	static pbuffer *frame;
+	struct forward_header fh;
+
+	if (!tunnel->channel)
+		return;
+	if (!frame)
+		frame = pbuffer_init();
+	pbuffer_clear(frame);
+
+	memset(&fh, 0, sizeof(fh));
+	strncpy(fh.tag, channel->tag, MAX_TAG);
+	fh.protocol = channel->protocol;
+	fh.src = channel->src;
+	fh.stream = channel->stream;
+	fh.command = CT_WINDOW;
+	fh.arg = channel->rx_window - WINDOW_INIT;
+	tlv_generate_frame(&fh, 0, frame);
+	egress_control(tunnel->channel, frame->data, frame->length);
+}
+
+/* set up the windows of a new stream, and grant the far side ours */
+static void stream_init(struct channel *channel, int open)
+{
+	channel->tx_window = WINDOW_INIT;
+	if (channel->rx_window < WINDOW_INIT)
+		channel->rx_window = WINDOW_INIT;
+	channel->on_sent = stream_credit;
+	if (open)
+		send_open(channel);
+	else if (channel->rx_window > WINDOW_INIT)
+		send_command(channel->stream, CT_WINDOW,
+			     channel->rx_window - WINDOW_INIT, -1);
+}
+
+static int stream_close(struct channel *channel)
+{
+	DB("Stream %u closed", channel->stream);
+	if (session_find(channel->stream) != channel)
+		return 0;
+	session_del(channel->stream);
+	send_close(channel->stream, channel->tagid);
+	return 0;
+}
+
+/* give an accepted client a stream of its own */
+int stream_open(struct channel *channel)
+{
+	if (!next_stream)
+		next_stream = tunnel->remote ? 1 : 2;
+
+	/* skip ids that are still in use after wrapping around */
+	while (session_find(next_stream) || !next_stream)
+		next_stream += 2;
+
+	channel->stream = next_stream;
+	next_stream += 2;
+	channel->on_close = stream_close;
+	session_add(channel->stream, channel);
+	DB("Stream %u for %s", channel->stream,
+	   psockaddr_string(&channel->src));
+
+	/* the stream is set up on the far side before the client has sent
+	 * anything */
+	stream_init(channel, 1);
+	return 0;
+}
+
+/* Connect a dedicated output for a new stream from the far side. Its
+ * frames are queued while it connects; when it cannot connect, it is
+ * closed, and the far side told so. */
+struct channel *stream_connect(struct forward_header *fh)
+{
+	struct conf_output *output = tag_output(tag_lookup(fh->tag));
+	struct channel *channel;
+
+	if (!output) {
+		DB("No output for tag %s; refusing stream %u", fh->tag,
+		   fh->stream);
+		send_close(fh->stream, -1);
+		return NULL;
+	}
+
+	channel = new_connecter(deque, output->dst, output->dport,
+				output->protocol);
+	if (!channel) {
+		DBWARN("Could not connect stream %u to %s:%u", fh->stream,
+		       output->dst, output->dport);
+		send_close(fh->stream, -1);
+		return NULL;
+	}
+
+	strncpy(channel->tag, output->tag, MAX_TAG);
+	channel->tagid = output->tagid;
+	channel->stream = fh->stream;
+	channel->rx_window = output->opts.window;
+	channel->idle_timeout = output->opts.idle * 1000;
+	channel->halfopen_timeout = output->opts.halfopen * 1000;
+	channel->connect_tries = CONNECT_TRIES;
+	channel->on_close = stream_close;
+	session_add(channel->stream, channel);
+	DB("Stream %u from %s connects to %s:%u", fh->stream,
+	   psockaddr_string(&fh->src), output->dst, output->dport);
+	stream_init(channel, 0);
+	channel_watch(channel);
+	return channel;
+}
+
+/* the far side closed the stream; close ours once its queue is sent */
+void stream_remote_close(unsigned int stream)
+{
+	struct channel *channel = session_find(stream);
+
+	if (!channel)
+		return;
+	DB("Stream %u closed by the far side", stream);
+	session_del(stream);
+	channel_shutdown(channel);
+}
+
+/* the far side granted the stream more credit */
+void stream_window(unsigned int stream, unsigned int credit)
+{
+	struct channel *channel = session_find(stream);
+
+	if (!channel)
+		return;
+	channel->tx_window += credit;
+	DB("Stream %u may send %zu bytes", stream, channel->tx_window);
+
+	/* resume reading, unless it waits for the tunnel to drain */
+	if (channel->tx_window && !(channel->events & EV_INPUT) &&
+	    !list_is_linked(&channel->wlist))
+		channel_set_events(channel, channel->events | EV_INPUT);
+}
+
+/* the stream sent this much over the tunnel */
+void stream_forwarded(struct channel *channel, size_t bytes)
+{
+	if (bytes > channel->tx_window)
+		bytes = channel->tx_window;
+	channel->tx_window -= bytes;
+	if (channel->tx_window)
+		return;
+
+	DB("Stream %u is out of credit", channel->stream);
+	stats.stalls++;
+	channel_set_events(channel, channel->events & ~EV_INPUT);
+}
+
+/* whether credit can still come for the stream: the tunnel is up, and the
+ * far side knows the stream */
+int stream_live(struct channel *channel)
+{
+	struct channel *out = tunnel->channel;
+
+	if (!out || out == tunnel->listener || (out->flags & CHAN_CONNECT))
+		return 0;
+	return session_find(channel->stream) == channel;
+}
+
+/* the far side sent this much for the stream to its output */
+void stream_delivered(struct channel *channel, size_t bytes)
+{
+	channel->rx_credit += bytes;
+	stream_credit(channel);
+}
@@ -0,0 +1,34 @@
+#ifndef SESSIONS_H
+#define SESSIONS_H
+
+#include "channels.h"
+#include "forward.h"
+
+/* Every client accepted on a TCP input is a stream of its own on the
+ * tunnel. The side that accepts the client picks the stream id: odd ids
+ * when we connected the tunnel, even ones when we accepted it, so the two
+ * sides never pick the same one. The far side connects a dedicated output
+ * for every new stream, and both sides keep a session table from stream id
+ * to channel to route the frames of a stream, and its replies. The frame
+ * that sets up a stream carries its tag, protocol and source; the frames
+ * after it carry only the stream id, until a CT_CLOSE tears it down. */
+
+/* Every stream has a credit window in each direction, like the
+ * WINDOW_UPDATE of HTTP/2. A stream starts with WINDOW_INIT bytes it may
+ * send. The receiving side grants the rest of the window it wants (the
+ * window of its tag) right away, and grants more with CT_WINDOW as the
+ * bytes leave its output. A stream whose window is used up is not read
+ * until credit comes in, while the other streams carry on. */
+#define WINDOW_INIT (16 * 1024)
+
+int stream_open(struct channel *);
+struct channel *stream_connect(struct forward_header *);
+void stream_remote_close(unsigned int );
+void stream_window(unsigned int , unsigned int );
+void stream_forwarded(struct channel *, size_t );
+void stream_delivered(struct channel *, size_t );
+int stream_live(struct channel *);
+struct channel *session_find(unsigned int );
+void sessions_reset(void);
+
+#endif /* SESSIONS_H */
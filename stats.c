@@ -0,0 +1,45 @@
+#include "stats.h"
+#include "conf.h"
+#include "logging.h"
+#include "compress.h"
+#include "alive.h"
+
+struct stats stats;
+
+#define DBSTAT(fmt, args...) debug(1, "[stat]: " fmt, ##args)
+
+/* average per event, with one decimal */
+#define per_event(n, e) ((e) ? (n) * 10 / (e) : 0)
+
+void stats_dump(void)
+{
+	DBSTAT("rx: %lu events, %lu calls (%lu.%lu/event), %lu bytes",
+	       stats.rx_events, stats.rx_calls,
+	       per_event(stats.rx_calls, stats.rx_events) / 10,
+	       per_event(stats.rx_calls, stats.rx_events) % 10,
+	       stats.rx_bytes);
+	DBSTAT("tx: %lu calls, %lu bytes", stats.tx_calls, stats.tx_bytes);
+	DBSTAT("refused: %lu", stats.refused);
+	DBSTAT("window stalls: %lu", stats.stalls);
+	DBSTAT("memory cap waits: %lu", stats.memwaits);
+	DBSTAT("reaped: %lu idle, %lu half-open", stats.reaped_idle,
+	       stats.reaped_halfopen);
+	DBSTAT("connects: %lu, %lu retried, %lu given up", stats.connects,
+	       stats.connect_retries, stats.connect_failures);
+	DBSTAT("egress: %lu frames, flushed %lu at once, %lu full, "
+	       "%lu on deadline", stats.egress_frames, stats.flush_now,
+	       stats.flush_full, stats.flush_deadline);
+	DBSTAT("buffers: %zu live, %zu pooled, %zu peak, %lu allocs "
+	       "(%lu reused), %lu refused", pbuffer_pool.live,
+	       pbuffer_pool.pooled, pbuffer_pool.peak, pbuffer_pool.allocs,
+	       pbuffer_pool.reused, pbuffer_pool.refused);
+	compress_stats();
+	alive_stats();
+}
+
+int stats_timer(struct timer *timer, uint64_t now)
+{
+	stats_dump();
+	timer_arm(timer, settings.stats_interval * 1000, stats_timer);
+	return 0;
+}
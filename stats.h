@@ -0,0 +1,46 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "timer.h"
+
+struct stats {
+	/* receive path */
+	unsigned long rx_events;	/* read events handled */
+	unsigned long rx_calls;		/* syscalls made to receive */
+	unsigned long rx_bytes;
+
+	/* send path */
+	unsigned long tx_calls;
+	unsigned long tx_bytes;
+
+	/* clients refused because of the channel limit */
+	unsigned long refused;
+
+	/* streams stopped because their window was used up */
+	unsigned long stalls;
+	/* channels stopped because the buffers reached the memory cap */
+	unsigned long memwaits;
+
+	/* streams closed for lack of traffic, or for not draining after the
+	 * far side closed them */
+	unsigned long reaped_idle;
+	unsigned long reaped_halfopen;
+
+	/* connects that completed, were tried again, and were given up */
+	unsigned long connects;
+	unsigned long connect_retries;
+	unsigned long connect_failures;
+
+	/* frames for the tunnel, and why they were flushed to it */
+	unsigned long egress_frames;
+	unsigned long flush_now;	/* at once: nodelay, control, no coalescing */
+	unsigned long flush_full;	/* enough bytes were held */
+	unsigned long flush_deadline;	/* the flush delay passed */
+};
+
+extern struct stats stats;
+
+void stats_dump(void);
+int stats_timer(struct timer *, uint64_t );
+
+#endif /* STATS_H */
@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tags.h"
+#include "channels.h"
+#include "logging.h"
+
+#define DB(fmt, args...) debug(3, "[tags]: " fmt, ##args)
+
+/* the hash is kept at most half full */
+#define TAGHASH_MIN 16
+
+static struct tag *tags;
+static int ntags;
+static int tags_size;
+
+/* slots hold tag ids; 0 is an empty slot */
+static int *taghash;
+static size_t taghash_size;
+
+/* FNV-1a */
+static unsigned int tag_hash(const char *name)
+{
+	unsigned int h = 2166136261u;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619;
+	}
+	return h;
+}
+
+static size_t tag_slot(const char *name)
+{
+	size_t mask = taghash_size - 1;
+	size_t i = tag_hash(name) & mask;
+
+	while (taghash[i] && strcmp(tags[taghash[i]].name, name))
+		i = (i + 1) & mask;
+	return i;
+}
+
+static void taghash_grow(void)
+{
+	int *old = taghash;
+	size_t i, oldsize = taghash_size;
+
+	taghash_size = oldsize ? oldsize * 2 : TAGHASH_MIN;
+	taghash = calloc(taghash_size, sizeof(int));
+	for (i = 0; i < oldsize; i++) {
+		if (old[i])
+			taghash[tag_slot(tags[old[i]].name)] = old[i];
+	}
+	free(old);
+}
+
+/* Return the id of the tag, adding it if it is new */
+int tag_intern(const char *name)
+{
+	size_t slot;
+	int id;
+
+	if ((id = tag_lookup(name)))
+		return id;
+
+	/* id 0 is never used, so there is always one more */
+	if (ntags + 2 > tags_size) {
+		tags_size = tags_size ? tags_size * 2 : TAGHASH_MIN;
+		tags = realloc(tags, tags_size * sizeof(struct tag));
+	}
+	if ((ntags + 1) * 2 > taghash_size)
+		taghash_grow();
+
+	id = ++ntags;
+	memset(&tags[id], 0, sizeof(struct tag));
+	strncpy(tags[id].name, name, MAX_TAG - 1);
+	slot = tag_slot(tags[id].name);
+	taghash[slot] = id;
+	DB("Tag %s is %d", tags[id].name, id);
+	return id;
+}
+
+/* Return the id of the tag, or 0 if it is unknown */
+int tag_lookup(const char *name)
+{
+	if (!taghash_size)
+		return 0;
+	return taghash[tag_slot(name)];
+}
+
+const char *tag_name(int id)
+{
+	if (id <= 0 || id > ntags)
+		return "";
+	return tags[id].name;
+}
+
+void tag_index_reset(void)
+{
+	int id;
+
+	for (id = 1; id <= ntags; id++) {
+		tags[id].channel = NULL;
+		tags[id].output = NULL;
+	}
+}
+
+void tag_bind(int id, struct channel *channel)
+{
+	if (id <= 0 || id > ntags)
+		return;
+	tags[id].channel = channel;
+}
+
+void tag_bind_output(int id, struct conf_output *output)
+{
+	if (id <= 0 || id > ntags)
+		return;
+	tags[id].output = output;
+}
+
+/* forget the channel, if the index points at it */
+void tag_unbind(struct channel *channel)
+{
+	int id = channel->tagid;
+
+	if (id > 0 && id <= ntags && tags[id].channel == channel)
+		tags[id].channel = NULL;
+}
+
+struct channel *tag_channel(int id)
+{
+	if (id <= 0 || id > ntags)
+		return NULL;
+	return tags[id].channel;
+}
+
+struct conf_output *tag_output(int id)
+{
+	if (id <= 0 || id > ntags)
+		return NULL;
+	return tags[id].output;
+}
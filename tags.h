@@ -0,0 +1,29 @@
+#ifndef TAGS_H
+#define TAGS_H
+
+#include "conf.h"
+
+/* Tags are interned when the config is read: every distinct tag gets a
+ * small integer id (starting at 1; 0 is no tag). An open addressing hash
+ * finds the id of a tag name, and the id indexes the channel that carries
+ * the tag, and the output that new streams for the tag connect to. */
+
+struct tag {
+	char name[MAX_TAG];
+	struct channel *channel;
+	struct conf_output *output;
+};
+
+int tag_intern(const char *);
+int tag_lookup(const char *);
+const char *tag_name(int );
+
+/* the index from tag id to channel; rebuilt by create_sockets() */
+void tag_index_reset(void);
+void tag_bind(int , struct channel *);
+void tag_bind_output(int , struct conf_output *);
+void tag_unbind(struct channel *);
+struct channel *tag_channel(int );
+struct conf_output *tag_output(int );
+
+#endif /* TAGS_H */
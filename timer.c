@@ -1,80 +1,200 @@
 #include <time.h>
-#include <sys/time.h>
 #include "logging.h"
 #include "timer.h"
-#include "tlv.h"
-
-struct timer *timers;
 
 #define DB(fmt, args...) debug(3, "[timer]: " fmt, ##args)
 
-int on_alive(struct timer *timer, struct timeval *now)
+static struct list wheel[WHEEL_LEVELS * WHEEL_SLOTS];
+/* the slots with timers, a word per level */
+static uint64_t pending[WHEEL_LEVELS];
+/* the next millisecond to run; all timers before it have fired */
+static uint64_t clock_ms;
+static int wheel_ok;
+
+uint64_t timer_now(void)
 {
-	return 0;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-int keep_alive(struct timer *timer, struct timeval *now)
+static void wheel_init(void)
 {
-	struct channel *channel = timer->channel;
-	struct tlv *tlv = tlv_init();
-	DB("Sending keepalive");
-	tlv->type = T_COMMAND;
-	tlv->length = 1;
-	pbuffer_add_byte(tlv->value, CT_KEEPALIVE);
-	tlv_to_buffer(tlv, channel->send_buffer);
-	queue_send(channel);
-	timer_arm(timer, 5, keep_alive);
-	return 0;
+	int i;
+
+	for (i = 0; i < WHEEL_LEVELS * WHEEL_SLOTS; i++)
+		list_init(&wheel[i]);
+	clock_ms = timer_now();
+	wheel_ok = 1;
 }
 
-int timer_fire(struct timer *timer, struct timeval *now)
+/* Put the timer on the lowest wheel that reaches its time */
+static void wheel_add(struct timer *timer)
 {
-	if (!timer || !timer->armed)
-		return 0;
+	uint64_t diff;
+	int level, slot;
 
-	if (timer->tv.tv_sec > now->tv_sec)
-		return 0;
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		diff = (timer->expires >> (WHEEL_BITS * level)) -
+			(clock_ms >> (WHEEL_BITS * level));
+		if (diff < WHEEL_SLOTS)
+			break;
+	}
+	if (level == WHEEL_LEVELS) {
+		level--;
+		diff = WHEEL_MASK;
+	}
+	slot = ((clock_ms >> (WHEEL_BITS * level)) + diff) & WHEEL_MASK;
 
-	/* disarm timer and execute the callback */
-	timer->armed = 0;
-	if (timer->on_fire)
-		return timer->on_fire(timer, now);
+	timer->slot = level * WHEEL_SLOTS + slot;
+	list_append(wheel[timer->slot].prev, &timer->list);
+	pending[level] |= 1ULL << slot;
+}
+
+static void wheel_del(struct timer *timer)
+{
+	struct list *head = &wheel[timer->slot];
+
+	list_unlink(&timer->list);
+	list_init(&timer->list);
+	if (head->next == head)
+		pending[timer->slot / WHEEL_SLOTS] &=
+			~(1ULL << (timer->slot % WHEEL_SLOTS));
+}
+
+/* A turn of the wheel below level is done: move the timers of the slot
+ * that is now due down, after doing the same for the level above */
+static void cascade(int level)
+{
+	int slot = (clock_ms >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	struct list *head = &wheel[level * WHEEL_SLOTS + slot];
+	struct timer *timer;
 
-	return 0;
+	if (!slot && level + 1 < WHEEL_LEVELS)
+		cascade(level + 1);
+	while (head->next != head) {
+		timer = timer_of(head->next);
+		wheel_del(timer);
+		wheel_add(timer);
+	}
+}
+
+/* distance from slot to the next slot with timers on the level, counting
+ * from slot itself; WHEEL_SLOTS if there are none */
+static int next_pending(int level, int slot)
+{
+	uint64_t bits = pending[level];
+
+	if (!bits)
+		return WHEEL_SLOTS;
+	bits = slot ? (bits >> slot) | (bits << (WHEEL_SLOTS - slot)) : bits;
+	return __builtin_ctzll(bits);
 }
 
-void timer_arm(struct timer *timer, int timeout,
-	       int (*callback)(struct timer *, struct timeval *))
+void timer_arm(struct timer *timer, unsigned int timeout,
+	       int (*callback)(struct timer *, uint64_t ))
 {
-	if ((!timer) || (timeout < 0))
+	if (!timer)
 		return;
+	if (!wheel_ok)
+		wheel_init();
+	if (timer->armed)
+		wheel_del(timer);
 
-	gettimeofday(&timer->tv, NULL);
-	timer->tv.tv_sec += timeout;
+	timer->expires = timer_now() + timeout;
+	if (timer->expires < clock_ms)
+		timer->expires = clock_ms;
 	timer->on_fire = callback;
 	timer->armed = 1;
-	if (!list_is_linked(&timer->list)) {
-		list_append(&timers->list, &timer->list);
+	wheel_add(timer);
+}
+
+void timer_cancel(struct timer *timer)
+{
+	if (!timer || !timer->armed)
+		return;
+	wheel_del(timer);
+	timer->armed = 0;
+}
+
+/* Milliseconds until the first timer is due, or -1 when none is armed.
+ * A timer on a higher wheel counts from when its slot cascades, which
+ * is never later than the timer itself. */
+int timer_next_deadline(void)
+{
+	uint64_t next = UINT64_MAX, at, now;
+	int level, slot, d;
+
+	if (!wheel_ok)
+		return -1;
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		slot = (clock_ms >> (WHEEL_BITS * level)) & WHEEL_MASK;
+		if ((d = next_pending(level, slot)) == WHEEL_SLOTS)
+			continue;
+		if (!level)
+			at = clock_ms + d;
+		else
+			at = ((clock_ms >> (WHEEL_BITS * level)) + d) <<
+				(WHEEL_BITS * level);
+		if (at < next)
+			next = at;
 	}
+	if (next == UINT64_MAX)
+		return -1;
+	now = timer_now();
+	if (next <= now)
+		return 0;
+	return next - now > INT32_MAX ? INT32_MAX : next - now;
 }
 
+/* Fire the timers that are due. The clock skips over the slots that are
+ * empty, but stops at every turn of the first wheel to cascade. */
 int timer_check(void)
 {
-	int ret = 0;
-	struct timeval now;
+	struct list *head;
 	struct timer *timer;
+	uint64_t now, next;
+	int slot, d, fired = 0;
+
+	if (!wheel_ok)
+		return 0;
+	now = timer_now();
+	while (clock_ms <= now) {
+		slot = clock_ms & WHEEL_MASK;
+		if (!slot)
+			cascade(1);
+
+		head = &wheel[slot];
+		if (head->next == head) {
+			d = next_pending(0, slot);
+			if (d > WHEEL_SLOTS - slot)
+				d = WHEEL_SLOTS - slot;
+			next = clock_ms + (d ? d : 1);
+			clock_ms = next > now + 1 ? now + 1 : next;
+			continue;
+		}
 
-	gettimeofday(&now, NULL);
-	for_each_timer(timers, timer) {
-		timer_fire(timer, &now);
+		/* disarm the timers and execute the callbacks; they may
+		 * arm timers for this very slot */
+		while (head->next != head) {
+			timer = timer_of(head->next);
+			wheel_del(timer);
+			timer->armed = 0;
+			fired++;
+			if (timer->on_fire)
+				timer->on_fire(timer, now);
+		}
+		clock_ms++;
 	}
-	return ret;
+	return fired;
 }
 
 struct timer *timer_init(void)
 {
 	struct timer *timer = malloc(sizeof(struct timer));
 	timer->armed = 0;
+	timer->channel = NULL;
 	list_init(&timer->list);
 	return timer;
 }
@@ -1,31 +1,40 @@
 #ifndef TIMERS_H
 #define TIMERS_H
 
-#include <time.h>
-#include <sys/time.h>
+#include <stdint.h>
 #include "channels.h"
 #include "list.h"
 
-extern struct timer *timers;
+/* Timers live on a hierarchical timing wheel: WHEEL_LEVELS wheels of
+ * WHEEL_SLOTS slots each, on CLOCK_MONOTONIC in milliseconds. The first
+ * wheel has a slot per millisecond; a slot on the next one covers a whole
+ * turn of the one below, and its timers move down (cascade) when that turn
+ * comes. Arming and cancelling are O(1), and timer_check() only looks at
+ * the slots that are due. Timers further out than the wheels reach wait in
+ * the last slot of the top wheel and are put back every turn. */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
 
 struct timer {
 	int armed;
-	struct timeval tv;
+	/* when it fires, in ms of timer_now() */
+	uint64_t expires;
+	/* the slot it is on, as level * WHEEL_SLOTS + slot */
+	int slot;
 	struct channel *channel;
 	struct list list;
-	int (*on_fire)(struct timer *, struct timeval *);
+	int (*on_fire)(struct timer *, uint64_t );
 };
 
 #define timer_of(ptr) containerof(ptr, struct timer, list)
 
-#define for_each_timer(deque, ptr) for (ptr = timer_of(deque->list.next); \
-					ptr != deque;			\
-					ptr = timer_of(ptr->list.next))
-
-int keep_alive(struct timer *, struct timeval *);
-int timer_fire(struct timer *, struct timeval *);
-void timer_arm(struct timer *, int ,
-	       int (*)(struct timer *, struct timeval *));
+uint64_t timer_now(void);
+void timer_arm(struct timer *, unsigned int ,
+	       int (*)(struct timer *, uint64_t ));
+void timer_cancel(struct timer *);
+int timer_next_deadline(void);
 int timer_check(void);
 struct timer *timer_init(void);
 
@@ -13,6 +13,9 @@ const char *T_NAMES[T_NUM] = {
 	[T_DST] = "DST",
 	[T_PAYLOAD] = "PAYLOAD",
 	[T_COMMAND] = "COMMAND",
+	[T_STREAM] = "STREAM",
+	[T_ZPAYLOAD] = "ZPAYLOAD",
+	[T_STAMP] = "STAMP",
 };
 
 const char *PT_NAMES[PT_NUM] = {
@@ -24,271 +27,383 @@ const char *PT_NAMES[PT_NUM] = {
 const char *CT_NAMES[CT_NUM] = {
 	[CT_KEEPALIVE] = "KEEPALIVE",
 	[CT_ALIVE] = "ALIVE",
+	[CT_CLOSE] = "CLOSE",
+	[CT_WINDOW] = "WINDOW",
+	[CT_FEATURES] = "FEATURES",
 };
 
-unsigned char extract_byte(pbuffer *b)
-{
-	unsigned char holder;
-	pbuffer_safe_extract(b, &holder, 1);
-	return holder;
-}
-
-unsigned int extract_su(pbuffer *b, size_t len)
-{
-	unsigned short ret = 0;
-	while (len-- > 0) {
-		ret <<= 8;
-		ret |= extract_byte(b);
-	}
-	return ntohs(ret);
-}
-
-static void ip_to_buffer(pbuffer *b, unsigned char *addr, size_t len)
-{
-	size_t i;
-	pbuffer_assure(b, b->length + len);
-	for (i = 0; i < len; i++) {
-		pbuffer_add(b, &addr[i], 1);
-	}
-}
-
-char *extract_ip(struct psockaddr *psa, pbuffer *b, size_t len)
-{
-	int i;
-	if (len == 4) {
-		unsigned char *addr = (unsigned char *)&psa->v4.sin_addr;
-		psa->af = AF_INET;
-		psa->v4.sin_family = AF_INET;
-		for (i=0; i<len; i++) {
-			addr[i] = extract_byte(b);
-		}
-	} else if (len == 16) {
-		psa->af = AF_INET6;
-		psa->v6.sin6_family = AF_INET6;
-		for (i=0; i<len; i++) {
-			psa->v6.sin6_addr.s6_addr[i] = extract_byte(b);
-		}
-	} else {
-		DBERR("Cannot convert IP address (length != 4/16)");
-		return "";
-	}
-	return addrstr(psa);
-}
-
+/* the tlvs of the address; all their types and lengths are below 128, so
+ * each takes one byte */
 static size_t psockaddr_to_tlv(struct psockaddr *psa, pbuffer *b)
 {
-	struct tlv *tlv = tlv_init();
-	unsigned char holder;
 	size_t length = b->length;
 
 	if (psa->af) {
-		tlv->type = PT_FAMILY;
-		tlv->length = 1;
-		holder = psa->af & 0xff;
-		pbuffer_add(tlv->value, &holder, 1);
-		tlv_to_buffer(tlv, b);
-		tlv_clear(tlv);
+		pbuffer_add_byte(b, PT_FAMILY);
+		pbuffer_add_byte(b, 1);
+		pbuffer_add_byte(b, psa->af & 0xff);
 	}
 
 	if (psa->af == AF_INET) {
-		tlv->type = PT_IPADDR;
-		tlv->length = 4;
-		ip_to_buffer(tlv->value, (unsigned char *)&psa->v4.sin_addr,
-			     tlv->length);
-		tlv_to_buffer(tlv, b);
+		pbuffer_add_byte(b, PT_IPADDR);
+		pbuffer_add_byte(b, 4);
+		pbuffer_add(b, &psa->v4.sin_addr, 4);
 	} else if (psa->af == AF_INET6) {
-		tlv->type = PT_IPADDR;
-		tlv->length = 16;
-		ip_to_buffer(tlv->value, (unsigned char *)&psa->v6.sin6_addr,
-			     tlv->length);
-		tlv_to_buffer(tlv, b);
+		pbuffer_add_byte(b, PT_IPADDR);
+		pbuffer_add_byte(b, 16);
+		pbuffer_add(b, &psa->v6.sin6_addr, 16);
 	}
-	tlv_clear(tlv);
 
 	if (psa->v6.sin6_port) {
-		tlv->type = PT_PORT;
-		tlv->length = sizeof(uint16_t);
-		pbuffer_add(tlv->value, &(psa->v6.sin6_port),
-			    tlv->length);
-		tlv_to_buffer(tlv, b);
-		tlv_clear(tlv);
+		pbuffer_add_byte(b, PT_PORT);
+		pbuffer_add_byte(b, sizeof(uint16_t));
+		pbuffer_add(b, &psa->v6.sin6_port, sizeof(uint16_t));
 	}
 
 	return b->length - length;
 }
 
-static void tlv_to_psockaddr(pbuffer *b, struct psockaddr *psa)
+/* Read the tlv at data without copying it; the value points into data.
+ * Returns the size of the whole tlv, 0 when data does not hold all of it
+ * yet, or -1 when it is malformed. */
+ssize_t tlv_view(unsigned char *data, size_t avail, struct tlv_view *tv)
 {
-	struct tlv *tlv = tlv_init();
-	while (b->length) {
-		buffer_to_tlv(b, tlv);
-		switch (tlv->type) {
+	int t, l;
+
+	if ((t = torv_get(data, avail, &tv->type)) <= 0)
+		return t;
+	if ((l = torv_get(data + t, avail - t, &tv->length)) <= 0)
+		return l;
+	if (avail - t - l < tv->length)
+		return 0;
+	tv->value = data + t + l;
+	return t + l + tv->length;
+}
+
+/* The size of the frame at data, its length included, or 0 when the
+ * length is not all there */
+size_t tlv_frame_size(unsigned char *data, size_t avail)
+{
+	unsigned int flen;
+	int n = torv_get(data, avail, &flen);
+
+	return n > 0 ? n + flen : 0;
+}
+
+/* The next tlv under the cursor. Returns 1, 0 at the end, or -1 when
+ * the tlv is malformed or runs past the end. */
+int tlv_next(struct tlv_cursor *c, struct tlv_view *tv)
+{
+	ssize_t n;
+
+	if (!c->avail)
+		return 0;
+	if ((n = tlv_view(c->pos, c->avail, tv)) <= 0)
+		return -1;
+	c->pos += n;
+	c->avail -= n;
+	return 1;
+}
+
+/* The next frame under the cursor; frame becomes a cursor over its tlvs.
+ * Returns 1, 0 at the end, or -1 when the frame does not fit. */
+int tlv_next_frame(struct tlv_cursor *c, struct tlv_cursor *frame)
+{
+	unsigned int flen;
+	int n;
+
+	if (!c->avail)
+		return 0;
+	n = torv_get(c->pos, c->avail, &flen);
+	if (n <= 0 || c->avail - n < flen)
+		return -1;
+	tlv_cursor_init(frame, c->pos + n, flen);
+	c->pos += n + flen;
+	c->avail -= n + flen;
+	return 1;
+}
+
+static void view_to_psockaddr(struct tlv_view *v, struct psockaddr *psa)
+{
+	struct tlv_cursor c;
+	struct tlv_view pt;
+
+	memset(psa, 0, sizeof(*psa));
+	tlv_cursor_init(&c, v->value, v->length);
+	while (tlv_next(&c, &pt) > 0) {
+		switch (pt.type) {
 		case PT_FAMILY:
-			psa->af = extract_byte(tlv->value);
+			if (pt.length == 1)
+				psa->af = pt.value[0];
 			break;
 		case PT_IPADDR:
+			if (pt.length == 4)
+				memcpy(&psa->v4.sin_addr, pt.value, 4);
+			else if (pt.length == 16)
+				memcpy(&psa->v6.sin6_addr, pt.value, 16);
+			break;
 		case PT_PORT:
+			if (pt.length == sizeof(uint16_t))
+				memcpy(&psa->v6.sin6_port, pt.value,
+				       pt.length);
 			break;
 		}
 	}
-	tlv_free(tlv);
-	return;
+	if (psa->af) {
+		psa->v6.sin6_family = psa->af;
+		addrstr(psa);
+	}
 }
 
-void tlv_parse_tags(pbuffer *b, struct forward_header *fh)
+/* a big endian number of at most 4 bytes */
+static unsigned int view_uint(struct tlv_view *tv)
 {
-	struct tlv *tlv = tlv_init();
-	while (b->length) {
-		buffer_to_tlv(b, tlv);
-		switch (tlv->type) {
+	unsigned int num = 0, i;
+
+	for (i = 0; i < tv->length; i++)
+		num = (num << 8) | tv->value[i];
+	return num;
+}
+
+/* Parse the tlvs of one frame into fh; the payload becomes a view into
+ * the frame. Returns -1 when the frame is malformed. */
+static int parse_frame(unsigned char *data, size_t len,
+		       struct forward_header *fh, pbuffer *payload)
+{
+	struct tlv_cursor c;
+	struct tlv_view tv;
+	int n, z;
+
+	tlv_cursor_init(&c, data, len);
+	while ((n = tlv_next(&c, &tv)) > 0) {
+		switch (tv.type) {
 		case T_TAG:
-			if (tlv->length > MAX_TAG)
-				return;
-			strncpy(fh->tag, tlv->value->data, tlv->length);
-			fh->tag[tlv->length] = '\0';
+			if (tv.length >= MAX_TAG)
+				break;
+			memcpy(fh->tag, tv.value, tv.length);
+			fh->tag[tv.length] = '\0';
 			DB("Found tag: %s", fh->tag);
 			break;
 		case T_PROTOCOL:
 			/* Must be 1 byte long */
-			if (tlv->length == 1)
-				fh->protocol = extract_byte(tlv->value);
+			if (tv.length == 1)
+				fh->protocol = tv.value[0];
 			break;
 		case T_SRC:
-			tlv_to_psockaddr(tlv->value, &fh->src);
+			view_to_psockaddr(&tv, &fh->src);
 			break;
 		case T_DST:
-			tlv_to_psockaddr(tlv->value, &fh->dst);
+			view_to_psockaddr(&tv, &fh->dst);
 			break;
 		case T_PAYLOAD:
 			/* found payload */
-			DB("Found payload (%u)", tlv->length);
-			hexdump(3, tlv->value->data, tlv->value->length);
-			fh->payload = pbuffer_init();
-			pbuffer_copy(fh->payload, tlv->value, tlv->length);
+			DB("Found payload (%u)", tv.length);
+			hexdump(3, tv.value, tv.length);
+			payload->start = payload->data = tv.value;
+			payload->allocated = payload->length = tv.length;
+			fh->payload = payload;
+			break;
+		case T_ZPAYLOAD:
+			/* the size it inflates to, then the deflated data */
+			z = torv_get(tv.value, tv.length, &fh->zlength);
+			if (z <= 0 || !fh->zlength)
+				return -1;
+			DB("Found deflated payload (%u of %u)", tv.length - z,
+			   fh->zlength);
+			payload->start = payload->data = tv.value + z;
+			payload->allocated = payload->length = tv.length - z;
+			fh->payload = payload;
+			break;
+		case T_COMMAND:
+			/* one ct_type, with an optional number */
+			if (tlv_view(tv.value, tv.length, &tv) <= 0 ||
+			    tv.length > sizeof(fh->arg))
+				return -1;
+			fh->command = tv.type;
+			fh->arg = view_uint(&tv);
+			break;
+		case T_STREAM:
+			if (tv.length > sizeof(fh->stream))
+				return -1;
+			fh->stream = view_uint(&tv);
+			break;
+		case T_STAMP:
+			if (tv.length > sizeof(fh->stamp))
+				return -1;
+			fh->stamp = view_uint(&tv);
 			break;
 		}
-		tlv_clear(tlv);
 	}
-	tlv_free(tlv);
+	return n;
 }
 
-void tlv_generate_tags(struct forward_header *fh, pbuffer *b)
+/* Parse the complete frames in the buffer without copying anything. A
+ * frame is its length followed by its tlvs. Every frame with a payload or
+ * a command is handed to deliver(); the payload is a view into the buffer.
+ * deliver() returns nonzero
+ * when the output cannot take the payload yet; parsing then stops, so that
+ * frame is parsed again later. *need is set to the size of the frame at
+ * the end that is not complete yet, if it is known. Returns the number of
+ * bytes that can be consumed, or -1 when the buffer is malformed. */
+ssize_t tlv_parse_frames(pbuffer *b, size_t *need,
+			 int (*deliver)(struct forward_header *))
 {
-	struct tlv *tlv = tlv_init();
-
-	if (fh->tag) {
-		tlv->type = T_TAG;
-		tlv->length = strlen(fh->tag);
-		pbuffer_add(tlv->value, fh->tag, tlv->length);
-		tlv_to_buffer(tlv, b);
-		tlv_clear(tlv);
-	}
+	unsigned char *data = b->data;
+	struct forward_header fh;
+	pbuffer payload;
+	unsigned int flen;
+	size_t used = 0;
+	int n;
+
+	*need = 0;
+	while (used < b->length) {
+		n = torv_get(data + used, b->length - used, &flen);
+		if (n < 0 || flen > FRAME_MAX)
+			return -1;
+		if (!n)
+			break;
+		if (b->length - used - n < flen) {
+			*need = n + flen;
+			break;
+		}
 
-	if (fh->protocol) {
-		tlv->type = T_PROTOCOL;
-		tlv->length = 1;
-		pbuffer_add(tlv->value, &fh->protocol, 1);
-		tlv_to_buffer(tlv, b);
-		tlv_clear(tlv);
+		memset(&fh, 0, sizeof(fh));
+		if (parse_frame(data + used + n, flen, &fh, &payload) < 0)
+			return -1;
+		if ((fh.payload || fh.command) && deliver(&fh))
+			break;
+		used += n + flen;
 	}
+	return used;
+}
 
-	if (fh->src.af) {
-		tlv->type = T_SRC;
-		tlv->length = psockaddr_to_tlv(&fh->src, tlv->value);
-		tlv_to_buffer(tlv, b);
-		tlv_clear(tlv);
-	}
+/* the number of bytes a number takes in big endian */
+static size_t uint_length(unsigned int num)
+{
+	size_t len;
 
-	if (fh->payload->length) {
-		tlv->type = T_PAYLOAD;
-		tlv->length = fh->payload->length;
-		pbuffer_copy(tlv->value, fh->payload, tlv->length);
-		tlv_to_buffer(tlv, b);
-		tlv_clear(tlv);
+	for (len = sizeof(num); len > 1; len--) {
+		if (num >> (8 * (len - 1)))
+			break;
 	}
-	tlv_free(tlv);
+	return len;
 }
 
-static unsigned int count_shift(unsigned int num)
+/* write a tlv holding a number, in as few bytes as it takes */
+static void uint_to_buffer(unsigned int type, unsigned int num, pbuffer *b)
 {
-	unsigned int count = 0;
-	while (num > (TLV_EXTEND - 1)) {
-		count++;
-		num = num >> 7;
-	}
-	return count;
+	size_t len = uint_length(num);
+	unsigned char *p;
+
+	pbuffer_assure(b, 2 * TORV_MAX + len);
+	p = torv_put(pbuffer_end(b), type);
+	p = torv_put(p, len);
+	while (len--)
+		*p++ = (num >> (8 * len)) & 0xff;
+	b->length = p - (unsigned char *)b->data;
 }
 
-int tlv_to_buffer(struct tlv *tlv, pbuffer *buffer)
+/* write only the type and length; the value is up to the caller */
+int tlv_header_to_buffer(unsigned int type, unsigned int length,
+			 pbuffer *buffer)
 {
-	char holder = 0;
-	unsigned int origlen = tlv->length;
-	unsigned int t_shift, l_shift;
-
-	t_shift = count_shift(tlv->type);
-	l_shift = count_shift(tlv->length);
-	/* set type */
-	while (t_shift > 0) {
-		holder |= ((tlv->type >> (7*t_shift)) | TLV_EXTEND);
-		pbuffer_add(buffer, &holder, 1);
-		holder = 0;
-		t_shift--;
-	}
-	holder |= tlv->type & (TLV_EXTEND - 1);
-	pbuffer_add(buffer, &holder, 1);
-
-	/* set length */
-	while (l_shift > 0) {
-		holder |= ((tlv->length >> (7*l_shift)) | TLV_EXTEND);
-		pbuffer_add(buffer, &holder, 1);
-		holder = 0;
-		l_shift--;
-	}
-	holder = tlv->length;
-	pbuffer_add(buffer, &holder, 1);
+	unsigned char *p;
 
-	pbuffer_add(buffer, tlv->value->data, origlen);
+	pbuffer_assure(buffer, 2 * TORV_MAX);
+	p = torv_put(pbuffer_end(buffer), type);
+	p = torv_put(p, length);
+	buffer->length = p - (unsigned char *)buffer->data;
 	return 0;
 }
 
-/* extract the type or value from buffer into dest */
-size_t extract_torv(pbuffer *buffer, unsigned int *dest)
+/* Generate the tlvs at the start of a frame: TAG, PROTOCOL, STREAM,
+ * COMMAND, STAMP and SRC. For the data of a channel these stay the same, so
+ * generate_tags() keeps them in channel->prefix. */
+void tlv_generate_prefix(struct forward_header *fh, pbuffer *b)
 {
-	unsigned int tmp = 0;
-	unsigned int holder = 0;
-	size_t bytes = 0;
-
-	do {
-		tmp <<= 7;
-		holder = extract_byte(buffer);
-		bytes++;
-		tmp |= holder & ~TLV_EXTEND;
-	} while (holder & TLV_EXTEND);
-
-	*dest = tmp;
-	return bytes;
-}
+	unsigned char proto = fh->protocol;
+	size_t len, at;
 
-void buffer_to_tlv(pbuffer *buffer, struct tlv *tlv)
-{
-	extract_torv(buffer, &tlv->type);
-	extract_torv(buffer, &tlv->length);
+	if (fh->tag[0]) {
+		len = strlen(fh->tag);
+		tlv_header_to_buffer(T_TAG, len, b);
+		pbuffer_add(b, fh->tag, len);
+	}
+
+	if (fh->protocol) {
+		tlv_header_to_buffer(T_PROTOCOL, 1, b);
+		pbuffer_add(b, &proto, 1);
+	}
+
+	if (fh->stream)
+		uint_to_buffer(T_STREAM, fh->stream, b);
+
+	if (fh->command) {
+		/* a CONSTRUCT of the command and its number */
+		len = fh->arg ? uint_length(fh->arg) : 0;
+		tlv_header_to_buffer(T_COMMAND, torv_size(fh->command) +
+				     torv_size(len) + len, b);
+		if (fh->arg)
+			uint_to_buffer(fh->command, fh->arg, b);
+		else
+			tlv_header_to_buffer(fh->command, 0, b);
+	}
 
-	pbuffer_copy(tlv->value, buffer, tlv->length);
+	if (fh->stamp)
+		uint_to_buffer(T_STAMP, fh->stamp, b);
 
-	pbuffer_shift(buffer, tlv->length);
+	if (fh->src.af) {
+		/* an address is less than 128 bytes; its length is a byte */
+		pbuffer_add_byte(b, T_SRC);
+		pbuffer_add_byte(b, 0);
+		at = b->length - 1;
+		len = psockaddr_to_tlv(&fh->src, b);
+		((unsigned char *)b->data)[at] = len;
+	}
 }
 
-struct tlv *tlv_init(void)
+/* Generate the start of a frame: its length, the prefix, and the type and
+ * length of the payload. The payload can then be sent from where it is,
+ * without copying it. When zlength is set, paylen bytes of deflated data
+ * follow in a ZPAYLOAD instead. */
+void tlv_generate_start(pbuffer *prefix, unsigned int zlength, size_t paylen,
+			pbuffer *b)
 {
-	struct tlv *tmp;
-	tmp = malloc(sizeof(struct tlv));
-	tmp->value = pbuffer_init();
-	return tmp;
+	unsigned int type = T_PAYLOAD, length = paylen;
+	size_t flen = prefix->length;
+	unsigned char *p;
+
+	if (zlength) {
+		type = T_ZPAYLOAD;
+		length += torv_size(zlength);
+	}
+	if (length)
+		flen += torv_size(type) + torv_size(length) + length;
+
+	pbuffer_assure(b, prefix->length + 4 * TORV_MAX);
+	p = torv_put(pbuffer_end(b), flen);
+	memcpy(p, prefix->data, prefix->length);
+	p += prefix->length;
+	if (length) {
+		p = torv_put(p, type);
+		p = torv_put(p, length);
+	}
+	if (zlength)
+		p = torv_put(p, zlength);
+	b->length = p - (unsigned char *)b->data;
 }
 
-void tlv_free(struct tlv *tlv)
+/* Generate the start of a frame of its own, as tlv_generate_start() */
+void tlv_generate_frame(struct forward_header *fh, size_t paylen,
+			pbuffer *b)
 {
-	pbuffer_free(tlv->value);
-	free(tlv);
+	static pbuffer *prefix;
+
+	if (!prefix)
+		prefix = pbuffer_init();
+	pbuffer_clear(prefix);
+
+	tlv_generate_prefix(fh, prefix);
+	tlv_generate_start(prefix, fh->zlength, paylen, b);
 }
+
@@ -3,13 +3,22 @@
 
 #include "pbuffer.h"
 #include "forward.h"
+#include "varint.h"
 
-#define TLV_EXTEND 0x80
+/* the largest frame we accept from the tunnel */
+#define FRAME_MAX (16 * 1024 * 1024)
 
-struct tlv {
+/* a tlv as it is in a buffer; the value is not copied */
+struct tlv_view {
 	unsigned int type;
 	unsigned int length;
-	pbuffer *value;
+	unsigned char *value;
+};
+
+/* walks the tlvs (or frames) in a buffer in place */
+struct tlv_cursor {
+	unsigned char *pos;
+	size_t avail;
 };
 
 /* main tlv types */
@@ -20,6 +29,9 @@ enum t_types {
 	T_DST, /* CONSTRUCT of psock_types */
 	T_PAYLOAD,
 	T_COMMAND, /* CONSTRUCT of ct_types */
+	T_STREAM,
+	T_ZPAYLOAD, /* the payload size, then the deflated payload */
+	T_STAMP, /* when a keepalive was sent (us), echoed with CT_ALIVE */
 	T_NUM,
 };
 
@@ -33,8 +45,11 @@ enum psock_types {
 
 /* tlv types for command */
 enum ct_types {
-	CT_KEEPALIVE = 1,
-	CT_ALIVE,
+	CT_KEEPALIVE = 1, /* with its sequence number and a STAMP */
+	CT_ALIVE, /* the answer: the same number and STAMP */
+	CT_CLOSE, /* the stream is gone */
+	CT_WINDOW, /* the stream may send this many more bytes */
+	CT_FEATURES, /* what the sender can take (F_*) */
 	CT_NUM,
 };
 
@@ -42,21 +57,20 @@ extern const char *T_NAMES[T_NUM];
 extern const char *PT_NAMES[PT_NUM];
 extern const char *CT_NAMES[CT_NUM];
 
-static inline void tlv_clear(struct tlv *tlv)
+static inline void tlv_cursor_init(struct tlv_cursor *c, void *data,
+				   size_t len)
 {
-	tlv->type = 0;
-	tlv->length = 0;
-	pbuffer_clear(tlv->value);
+	c->pos = data;
+	c->avail = len;
 }
-unsigned char extract_byte(pbuffer *);
-unsigned int extract_su(pbuffer *, size_t );
-char *extract_ip(struct psockaddr *, pbuffer *, size_t );
-void tlv_parse_tags(pbuffer *, struct forward_header *);
-void tlv_generate_tags(struct forward_header *, pbuffer *);
-int tlv_to_buffer(struct tlv *, pbuffer *);
-void buffer_to_tlv(pbuffer *, struct tlv *);
-size_t extract_torv(pbuffer *, unsigned int *);
-
-struct tlv *tlv_init();
-void tlv_free(struct tlv *);
+ssize_t tlv_view(unsigned char *, size_t , struct tlv_view *);
+int tlv_next(struct tlv_cursor *, struct tlv_view *);
+int tlv_next_frame(struct tlv_cursor *, struct tlv_cursor *);
+size_t tlv_frame_size(unsigned char *, size_t );
+ssize_t tlv_parse_frames(pbuffer *, size_t *,
+			 int (*)(struct forward_header *));
+void tlv_generate_prefix(struct forward_header *, pbuffer *);
+void tlv_generate_start(pbuffer *, unsigned int , size_t , pbuffer *);
+void tlv_generate_frame(struct forward_header *, size_t , pbuffer *);
+int tlv_header_to_buffer(unsigned int , unsigned int , pbuffer *);
 #endif /* TLV_H */
@@ -0,0 +1,105 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <stddef.h>
+
+/* Types and lengths (torv) are written in groups of 7 bits, the most
+ * significant group first; every byte but the last has TLV_EXTEND set.
+ * These work on raw pointers: the caller makes sure there is room for
+ * TORV_MAX bytes when writing. Nearly all our types and lengths take one
+ * or two bytes, so those come first. */
+
+#define TLV_EXTEND 0x80
+/* the longest type or length in bytes (32 bits in groups of 7) */
+#define TORV_MAX 5
+
+/* bytes a torv takes, by the number of significant bits */
+static const unsigned char torv_sizes[33] = {
+	1, 1, 1, 1, 1, 1, 1, 1,
+	2, 2, 2, 2, 2, 2, 2,
+	3, 3, 3, 3, 3, 3, 3,
+	4, 4, 4, 4, 4, 4, 4,
+	5, 5, 5, 5,
+};
+
+static inline int torv_size(unsigned int num)
+{
+	return torv_sizes[num ? 32 - __builtin_clz(num) : 0];
+}
+
+/* write num at p; returns the end of what was written */
+static inline unsigned char *torv_put(unsigned char *p, unsigned int num)
+{
+	if (num < (1U << 7)) {
+		p[0] = num;
+		return p + 1;
+	}
+	if (num < (1U << 14)) {
+		p[0] = (num >> 7) | TLV_EXTEND;
+		p[1] = num & (TLV_EXTEND - 1);
+		return p + 2;
+	}
+
+	switch (torv_size(num)) {
+	case 5:
+		*p++ = (num >> 28) | TLV_EXTEND;
+		/* fall through */
+	case 4:
+		*p++ = ((num >> 21) & (TLV_EXTEND - 1)) | TLV_EXTEND;
+		/* fall through */
+	default:
+		*p++ = ((num >> 14) & (TLV_EXTEND - 1)) | TLV_EXTEND;
+		*p++ = ((num >> 7) & (TLV_EXTEND - 1)) | TLV_EXTEND;
+		*p++ = num & (TLV_EXTEND - 1);
+	}
+	return p;
+}
+
+/* Read a torv of at most avail bytes at p. Returns the number of bytes
+ * used, 0 when the data ends first, or -1 when it is longer than any
+ * valid value. */
+static inline int torv_get(const unsigned char *p, size_t avail,
+			   unsigned int *dest)
+{
+	unsigned int num;
+
+	if (avail >= 2) {
+		if (!(p[0] & TLV_EXTEND)) {
+			*dest = p[0];
+			return 1;
+		}
+		if (!(p[1] & TLV_EXTEND)) {
+			*dest = (p[0] & (TLV_EXTEND - 1)) << 7 | p[1];
+			return 2;
+		}
+	} else if (avail == 1 && !(p[0] & TLV_EXTEND)) {
+		*dest = p[0];
+		return 1;
+	}
+	if (avail < 3)
+		return 0;
+
+	num = (p[0] & (TLV_EXTEND - 1)) << 14 |
+		(p[1] & (TLV_EXTEND - 1)) << 7 | (p[2] & (TLV_EXTEND - 1));
+	if (!(p[2] & TLV_EXTEND)) {
+		*dest = num;
+		return 3;
+	}
+	if (avail < 4)
+		return 0;
+	num = num << 7 | (p[3] & (TLV_EXTEND - 1));
+	if (!(p[3] & TLV_EXTEND)) {
+		*dest = num;
+		return 4;
+	}
+	if (avail < 5)
+		return 0;
+	num = num << 7 | (p[4] & (TLV_EXTEND - 1));
+	if (!(p[4] & TLV_EXTEND)) {
+		*dest = num;
+		return 5;
+	}
+	return -1;
+}
+
+#endif /* VARINT_H */
@@ -0,0 +1,174 @@
+/* Compare the varint codec of varint.h with the functions it replaced:
+ * a count_shift() and a pbuffer_add() per byte to write, and an
+ * extract_byte() (which shifts the buffer) per byte to read. Run with
+ * 'make bench'. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pbuffer.h"
+#include "varint.h"
+
+#define VALUES (1 << 16)
+#define ROUNDS 200
+
+/* the old functions, as they were in tlv.c */
+static unsigned int count_shift(unsigned int num)
+{
+	unsigned int count = 0;
+	while (num > (TLV_EXTEND - 1)) {
+		count++;
+		num = num >> 7;
+	}
+	return count;
+}
+
+static void old_torv_to_buffer(unsigned int num, pbuffer *buffer)
+{
+	unsigned int shift = count_shift(num);
+	unsigned char holder;
+
+	while (shift > 0) {
+		holder = ((num >> (7*shift)) & (TLV_EXTEND - 1)) | TLV_EXTEND;
+		pbuffer_add(buffer, &holder, 1);
+		shift--;
+	}
+	holder = num & (TLV_EXTEND - 1);
+	pbuffer_add(buffer, &holder, 1);
+}
+
+static unsigned char extract_byte(pbuffer *b)
+{
+	unsigned char holder;
+	pbuffer_safe_extract(b, &holder, 1);
+	return holder;
+}
+
+static size_t old_extract_torv(pbuffer *buffer, unsigned int *dest)
+{
+	unsigned int tmp = 0;
+	unsigned int holder = 0;
+	size_t bytes = 0;
+
+	do {
+		tmp <<= 7;
+		holder = extract_byte(buffer);
+		bytes++;
+		tmp |= holder & ~TLV_EXTEND;
+	} while (holder & TLV_EXTEND);
+
+	*dest = tmp;
+	return bytes;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* mostly the one and two byte lengths of real frames */
+static unsigned int sample(void)
+{
+	int r = rand() % 100;
+
+	if (r < 60)
+		return rand() % 128;
+	if (r < 95)
+		return 128 + rand() % (16384 - 128);
+	if (r < 99)
+		return 16384 + rand() % (1 << 21);
+	return rand();
+}
+
+static void report(const char *what, double t, size_t n)
+{
+	printf("%-8s %8.2f ns/value\n", what, t * 1e9 / n);
+}
+
+int main(void)
+{
+	static unsigned int values[VALUES], got[VALUES];
+	pbuffer *b = pbuffer_init();
+	double t;
+	unsigned char *p;
+	size_t pos, len;
+	int i, r, n;
+
+	srand(1);
+	for (i = 0; i < VALUES; i++)
+		values[i] = sample();
+
+	/* both write the same bytes, and read them back */
+	for (i = 0; i < VALUES; i++)
+		old_torv_to_buffer(values[i], b);
+	len = b->length;
+	p = malloc(len + VALUES * TORV_MAX);
+	for (i = 0, pos = 0; i < VALUES; i++)
+		pos = torv_put(p + pos, values[i]) - p;
+	if (pos != len || memcmp(p, b->data, len)) {
+		printf("torv_put() differs from the old encoder\n");
+		return 1;
+	}
+	for (i = 0, pos = 0; i < VALUES; i++) {
+		if ((n = torv_get(p + pos, len - pos, &got[i])) <= 0 ||
+		    got[i] != values[i]) {
+			printf("torv_get() failed at value %d\n", i);
+			return 1;
+		}
+		pos += n;
+	}
+	free(p);
+	for (i = 0; i < VALUES; i++) {
+		old_extract_torv(b, &got[i]);
+		if (got[i] != values[i]) {
+			printf("the old decoder failed at value %d\n", i);
+			return 1;
+		}
+	}
+	printf("%d values, %.2f bytes each\n", VALUES, (double)len / VALUES);
+
+	t = now();
+	for (r = 0; r < ROUNDS; r++) {
+		pbuffer_clear(b);
+		for (i = 0; i < VALUES; i++)
+			old_torv_to_buffer(values[i], b);
+	}
+	report("old put", now() - t, (size_t)ROUNDS * VALUES);
+
+	t = now();
+	for (r = 0; r < ROUNDS; r++) {
+		pbuffer_clear(b);
+		pbuffer_assure(b, VALUES * TORV_MAX);
+		p = pbuffer_end(b);
+		for (i = 0; i < VALUES; i++)
+			p = torv_put(p, values[i]);
+		b->length = p - (unsigned char *)b->data;
+	}
+	report("new put", now() - t, (size_t)ROUNDS * VALUES);
+
+	t = now();
+	for (r = 0; r < ROUNDS; r++) {
+		b->data = b->start;
+		b->length = len;
+		for (i = 0; i < VALUES; i++)
+			old_extract_torv(b, &got[i]);
+	}
+	report("old get", now() - t, (size_t)ROUNDS * VALUES);
+
+	t = now();
+	for (r = 0; r < ROUNDS; r++) {
+		p = b->start;
+		for (i = 0, pos = 0; i < VALUES; i++)
+			pos += torv_get(p + pos, len - pos, &got[i]);
+	}
+	report("new get", now() - t, (size_t)ROUNDS * VALUES);
+
+	/* keep the reads from being optimized away */
+	for (i = 0, n = 0; i < VALUES; i++)
+		n += got[i] != values[i];
+	pbuffer_free(b);
+	return n != 0;
+}